@@ -0,0 +1,201 @@
+/*
+ * libmp1.c : Client library for the mp1 kernel module
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libmp1.h"
+
+/* PIDs per write in mp1_register_many, well below the module limit */
+#define MP1_BATCH 512
+
+/*
+ * Func: mp1_open
+ * Desc: Open the status file for reading and writing
+ *
+ */
+int mp1_open(struct mp1_handle *h)
+{
+	h->buf = NULL;
+	h->buf_size = 0;
+
+	h->fd = open(MP1_STATUS_FILE, O_RDWR);
+	return (h->fd < 0) ? -1 : 0;
+}
+
+/*
+ * Func: mp1_close
+ * Desc: Close the status file and free the read buffer
+ *
+ */
+void mp1_close(struct mp1_handle *h)
+{
+	if (h->fd >= 0) {
+		close(h->fd);
+	}
+	h->fd = -1;
+
+	free(h->buf);
+	h->buf = NULL;
+	h->buf_size = 0;
+}
+
+/*
+ * Func: mp1_write_cmd
+ * Desc: Write one command in a single write
+ *
+ */
+static int mp1_write_cmd(struct mp1_handle *h, const char *cmd, int len)
+{
+	ssize_t ret;
+
+	ret = write(h->fd, cmd, len);
+	if (ret < 0) {
+		return -1;
+	}
+	if (ret != len) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Func: mp1_register
+ * Desc: Register a process with the module
+ *
+ */
+int mp1_register(struct mp1_handle *h, pid_t pid)
+{
+	char cmd[32];
+	int len;
+
+	len = snprintf(cmd, sizeof(cmd), "%d\n", (int)pid);
+	return mp1_write_cmd(h, cmd, len);
+}
+
+/*
+ * Func: mp1_unregister
+ * Desc: Unregister a process from the module
+ *
+ */
+int mp1_unregister(struct mp1_handle *h, pid_t pid)
+{
+	char cmd[32];
+	int len;
+
+	len = snprintf(cmd, sizeof(cmd), "U %d\n", (int)pid);
+	return mp1_write_cmd(h, cmd, len);
+}
+
+/*
+ * Func: mp1_register_many
+ * Desc: Register processes MP1_BATCH PIDs per write
+ *
+ */
+int mp1_register_many(struct mp1_handle *h, const pid_t *pids, int n)
+{
+	char cmd[MP1_BATCH * 12 + 2];
+	int i, len = 0, ret = 0, err = 0;
+
+	for (i = 0; i < n; i++) {
+		len += sprintf(cmd + len, "%d ", (int)pids[i]);
+		if ((i + 1) % MP1_BATCH == 0 || i == n - 1) {
+			/* Keep going, the other batches may succeed */
+			if (mp1_write_cmd(h, cmd, len) < 0) {
+				ret = -1;
+				err = errno;
+			}
+			len = 0;
+		}
+	}
+
+	if (ret < 0) {
+		errno = err;
+	}
+	return ret;
+}
+
+/*
+ * Func: mp1_read_all
+ * Desc: Read the whole status file from the start into h->buf
+ *
+ */
+static ssize_t mp1_read_all(struct mp1_handle *h)
+{
+	size_t len = 0;
+	ssize_t ret;
+	char *buf;
+
+	if (lseek(h->fd, 0, SEEK_SET) < 0) {
+		return -1;
+	}
+
+	while (1) {
+		/* Keep room for the terminating NUL */
+		if (h->buf_size - len < 2) {
+			buf = realloc(h->buf, h->buf_size ? h->buf_size * 2 : 4096);
+			if (buf == NULL) {
+				return -1;
+			}
+			h->buf = buf;
+			h->buf_size = h->buf_size ? h->buf_size * 2 : 4096;
+		}
+
+		ret = read(h->fd, h->buf + len, h->buf_size - len - 1);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (ret == 0) {
+			break;
+		}
+		len += ret;
+	}
+
+	h->buf[len] = '\0';
+	return len;
+}
+
+/*
+ * Func: mp1_read_status
+ * Desc: Read and parse the pid:cpu_time lines of the status file
+ *
+ */
+int mp1_read_status(struct mp1_handle *h, struct mp1_status *st, int max)
+{
+	char *line, *end;
+	int n = 0;
+	long pid;
+
+	if (mp1_read_all(h) < 0) {
+		return -1;
+	}
+
+	for (line = h->buf; *line; line = end) {
+		end = strchr(line, '\n');
+		end = end ? end + 1 : line + strlen(line);
+
+		pid = strtol(line, &line, 10);
+		if (*line != ':') {
+			continue;
+		}
+
+		if (n < max) {
+			st[n].pid = pid;
+			st[n].cpu_time = strtoul(line + 1, NULL, 10);
+		}
+		n++;
+	}
+
+	return n;
+}
@@ -0,0 +1,47 @@
+/*
+ * libmp1.h : Client library for the mp1 kernel module
+ *
+ * Keeps /proc/mp1/status open so that registering, unregistering and
+ * reading the status cost one system call each instead of a shell.
+ */
+#ifndef __LIBMP1_INCLUDE__
+#define __LIBMP1_INCLUDE__
+
+#include <sys/types.h>
+
+#define MP1_STATUS_FILE "/proc/mp1/status"
+
+/* Connection to the module */
+struct mp1_handle {
+	int fd;
+	/* Buffer the status file is read into, grown as needed */
+	char *buf;
+	size_t buf_size;
+};
+
+/* One line of the status file */
+struct mp1_status {
+	pid_t pid;
+	unsigned long cpu_time;
+};
+
+/* All calls return -1 with errno set on failure */
+
+/* Open the status file */
+int mp1_open(struct mp1_handle *h);
+void mp1_close(struct mp1_handle *h);
+
+/* Register or unregister one process */
+int mp1_register(struct mp1_handle *h, pid_t pid);
+int mp1_unregister(struct mp1_handle *h, pid_t pid);
+
+/* Register n processes with as few writes as possible. Fails if any of
+   them was not registered. To learn which, write the same commands to
+   /proc/mp1/last_write instead and read it back on the same fd */
+int mp1_register_many(struct mp1_handle *h, const pid_t *pids, int n);
+
+/* Read the status file into at most max entries. Returns the number of
+   registered processes, which may be larger than max */
+int mp1_read_status(struct mp1_handle *h, struct mp1_status *st, int max);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * mp1.h : Definitions shared between the mp1 kernel module and user space
+ */
+#ifndef __MP1_INCLUDE__
+#define __MP1_INCLUDE__
+
+#include <linux/types.h>
+
+/* Character device exporting the binary snapshot.
+
+   read() on it blocks until an update pass changes the cpu times of a
+   process and returns struct mp1_record entries for only the processes
+   that changed since the previous read on the same file. The first read
+   returns every registered process. poll() reports POLLIN once per such
+   pass, and O_NONBLOCK reads fail with EAGAIN instead of blocking. A read
+   returns at most snapshot_max records; with a smaller buffer the rest
+   of the pass comes with the next reads. */
+#define MP1_DEVICE "/dev/mp1"
+
+/* Page size the snapshot layout is built on */
+#define MP1_SNAPSHOT_PAGE_SIZE 4096
+
+/* One tracked process. All times are in nanoseconds, last_update is
+   CLOCK_MONOTONIC */
+struct mp1_record {
+	__u32 pid;
+	__u32 pad;
+	__u64 utime;
+	__u64 stime;
+	__u64 runtime_ns;
+	__u64 last_update;
+};
+
+/* Header at offset 0 of the mmap()ed snapshot. The records array starts
+   at records_offset.
+
+   seq is odd while the module is rewriting the snapshot. A consistent
+   copy is taken by reading seq, copying the header and the records,
+   then reading seq again and retrying if it was odd or has changed */
+struct mp1_snapshot_header {
+	__u32 seq;
+	/* Number of valid records */
+	__u32 nr_records;
+	/* Number of registered processes, larger than nr_records if the
+	   snapshot is full */
+	__u32 nr_registered;
+	/* Capacity of the records array */
+	__u32 max_records;
+	__u32 record_size;
+	__u32 records_offset;
+	/* CLOCK_MONOTONIC time of the last update in nanoseconds */
+	__u64 timestamp;
+};
+
+/* Total size to mmap() for a snapshot with max_records records */
+#define MP1_SNAPSHOT_SIZE(max_records)					\
+	(MP1_SNAPSHOT_PAGE_SIZE +					\
+	 (((max_records) * sizeof(struct mp1_record) +			\
+	   MP1_SNAPSHOT_PAGE_SIZE - 1) & ~(MP1_SNAPSHOT_PAGE_SIZE - 1)))
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * mp1_bench.c: Update pass benchmark for mp1
+ *
+ * Registers N idle child processes (10000 by default) with the module
+ * and measures the cost of the update pass, first resolving every entry
+ * by pid on each pass (legacy_lookup=1, as mp1 used to do) and then
+ * using the task pinned at registration (legacy_lookup=0).
+ *
+ * Usage: mp1_bench [nr_processes] [interval_ms] [passes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define STATUS_FILE   "/proc/mp1/status"
+#define STATS_FILE    "/proc/mp1/stats"
+#define LOOKUP_PARAM  "/sys/module/mp1_kernel_mod/parameters/legacy_lookup"
+#define INTERVAL_PARAM "/sys/module/mp1_kernel_mod/parameters/interval_ms"
+
+/* PIDs registered per write */
+#define BATCH 512
+
+/*
+ * Func: write_file
+ * Desc: Write a string to a proc or sysfs file
+ *
+ */
+int write_file(const char *path, const char *str)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	ret = write(fd, str, strlen(str));
+	close(fd);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+/*
+ * Func: read_stat
+ * Desc: Read one value of /proc/mp1/stats
+ *
+ */
+unsigned long long read_stat(const char *name)
+{
+	char line[128];
+	unsigned long long value = 0;
+	size_t len = strlen(name);
+	FILE *fp;
+
+	fp = fopen(STATS_FILE, "r");
+	if (fp == NULL) {
+		perror(STATS_FILE);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, name, len) == 0 && line[len] == ':') {
+			value = strtoull(line + len + 1, NULL, 10);
+			break;
+		}
+	}
+
+	fclose(fp);
+	return value;
+}
+
+/*
+ * Func: register_children
+ * Desc: Register the children in batches of BATCH PIDs per write
+ *
+ */
+int register_children(pid_t *pids, int n)
+{
+	char buf[BATCH * 12 + 2];
+	int i, len = 0, fd;
+
+	fd = open(STATUS_FILE, O_WRONLY);
+	if (fd < 0) {
+		perror(STATUS_FILE);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		len += sprintf(buf + len, "%d ", pids[i]);
+		if ((i + 1) % BATCH == 0 || i == n - 1) {
+			if (write(fd, buf, len) < 0) {
+				perror("register");
+			}
+			len = 0;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Func: measure
+ * Desc: Reset the statistics, let the module run the given number of
+ *       passes and print the average and maximum pass cost
+ *
+ */
+void measure(const char *label, int interval_ms, int passes)
+{
+	write_file(STATS_FILE, "0");
+	usleep((useconds_t)interval_ms * 1000 * (passes + 1));
+
+	printf("%-14s entries=%llu passes=%llu avg_pass_ns=%llu max_pass_ns=%llu\n",
+	       label,
+	       read_stat("entries"),
+	       read_stat("passes"),
+	       read_stat("avg_pass_ns"),
+	       read_stat("max_pass_ns"));
+}
+
+int main(int argc, char **argv)
+{
+	int n = 10000, interval_ms = 100, passes = 50;
+	char interval[16];
+	pid_t *pids;
+	int i;
+
+	if (argc > 1) {
+		n = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		interval_ms = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		passes = atoi(argv[3]);
+	}
+
+	pids = calloc(n, sizeof(*pids));
+	if (pids == NULL) {
+		return 1;
+	}
+
+	/* Start the idle processes to track */
+	for (i = 0; i < n; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			pause();
+			_exit(0);
+		}
+		if (pids[i] < 0) {
+			perror("fork");
+			n = i;
+			break;
+		}
+	}
+
+	/* Before the first registration arms the timer */
+	sprintf(interval, "%d", interval_ms);
+	write_file(INTERVAL_PARAM, interval);
+
+	register_children(pids, n);
+
+	/* Before: pid lookup on every pass */
+	write_file(LOOKUP_PARAM, "1");
+	measure("legacy_lookup", interval_ms, passes);
+
+	/* After: pinned task references */
+	write_file(LOOKUP_PARAM, "0");
+	measure("pinned_task", interval_ms, passes);
+
+	/* Children exit and get unregistered by the module */
+	for (i = 0; i < n; i++) {
+		kill(pids[i], SIGKILL);
+	}
+	while (wait(NULL) > 0)
+		;
+
+	free(pids);
+	return 0;
+}
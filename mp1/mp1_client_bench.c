@@ -0,0 +1,159 @@
+/*
+ * mp1_client_bench.c: Registration and status read benchmark for libmp1
+ *
+ * For 10, 1000 and 10000 tracked processes (or the counts given on the
+ * command line), registers that many idle children one write per PID and
+ * reports registrations per second, then reads and parses
+ * /proc/mp1/status repeatedly and reports the read latency.
+ *
+ * Usage: mp1_client_bench [nr_processes...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "libmp1.h"
+
+/* Status reads per measurement */
+#define READS 100
+
+/*
+ * Func: now_ns
+ * Desc: CLOCK_MONOTONIC time in nanoseconds
+ *
+ */
+unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Func: start_children
+ * Desc: Fork n idle processes, returns how many were started
+ *
+ */
+int start_children(pid_t *pids, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			pause();
+			_exit(0);
+		}
+		if (pids[i] < 0) {
+			perror("fork");
+			break;
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Func: stop_children
+ * Desc: Kill and reap the children. The module drops them on exit
+ *
+ */
+void stop_children(pid_t *pids, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		kill(pids[i], SIGKILL);
+	}
+	while (wait(NULL) > 0)
+		;
+}
+
+/*
+ * Func: run
+ * Desc: Measure registrations/sec and status read latency with n
+ *       tracked processes
+ *
+ */
+void run(struct mp1_handle *h, int n)
+{
+	unsigned long long start, cost, total = 0, max = 0;
+	struct mp1_status *st;
+	pid_t *pids;
+	int i, found = 0;
+
+	pids = calloc(n, sizeof(*pids));
+	st = calloc(n + 1, sizeof(*st));
+	if (pids == NULL || st == NULL) {
+		free(pids);
+		free(st);
+		return;
+	}
+
+	n = start_children(pids, n);
+
+	/* One write per registration, as applications do */
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if (mp1_register(h, pids[i]) < 0) {
+			perror("register");
+		}
+	}
+	cost = now_ns() - start;
+
+	/* Read and parse the whole status file */
+	for (i = 0; i < READS; i++) {
+		start = now_ns();
+		found = mp1_read_status(h, st, n + 1);
+		start = now_ns() - start;
+
+		total += start;
+		if (start > max) {
+			max = start;
+		}
+	}
+
+	printf("pids=%-6d registered=%-6d reg_per_sec=%-10.0f "
+	       "read_avg_us=%-10.1f read_max_us=%.1f\n",
+	       n, found, cost ? n * 1e9 / cost : 0.0,
+	       total / 1e3 / READS, max / 1e3);
+
+	for (i = 0; i < n; i++) {
+		mp1_unregister(h, pids[i]);
+	}
+	stop_children(pids, n);
+
+	free(pids);
+	free(st);
+}
+
+int main(int argc, char **argv)
+{
+	int sizes[] = { 10, 1000, 10000 };
+	struct mp1_handle h;
+	int i;
+
+	if (mp1_open(&h) < 0) {
+		perror(MP1_STATUS_FILE);
+		return 1;
+	}
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++) {
+			run(&h, atoi(argv[i]));
+		}
+	} else {
+		for (i = 0; i < 3; i++) {
+			run(&h, sizes[i]);
+		}
+	}
+
+	mp1_close(&h);
+	return 0;
+}
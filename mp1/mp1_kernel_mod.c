@@ -4,137 +4,2336 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/list.h>
+#include <linux/rculist.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include <linux/mempool.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
 #include <asm/uaccess.h>
 #include <linux/kthread.h>
 #include <linux/sched.h>
+#include <linux/moduleparam.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/seqlock.h>
+#include <linux/poll.h>
+#include <trace/events/sched.h>
 
 #include "mp1_given.h"
+#include "mp1.h"
 
-/* Proc dir and proc entry to be added */
-static struct proc_dir_entry *proc_dir, *proc_entry;
+/* Sampling interval of the update thread in milliseconds. Can be changed
+   at runtime through /sys/module/mp1_kernel_mod/parameters/interval_ms,
+   the new value is used from the next sample on */
+#define MP1_MIN_INTERVAL_MS 1
+static unsigned int interval_ms = 5000;
+
+/* Func: mp1_set_interval
+ * Desc: Validate a new sampling interval written to the module parameter
+ *
+ */
+static int mp1_set_interval(const char *val, const struct kernel_param *kp)
+{
+	unsigned int ms;
+	int ret;
+
+	ret = kstrtouint(val, 0, &ms);
+	if (ret) {
+		return ret;
+	}
+
+	if (ms < MP1_MIN_INTERVAL_MS) {
+		return -EINVAL;
+	}
+
+	*(unsigned int *)kp->arg = ms;
+
+	return 0;
+}
+
+static struct kernel_param_ops mp1_interval_ops = {
+	.set = mp1_set_interval,
+	.get = param_get_uint,
+};
+module_param_cb(interval_ms, &mp1_interval_ops, &interval_ms, 0644);
+MODULE_PARM_DESC(interval_ms, "Sampling interval in milliseconds (>= 1)");
+
+/* Accounting mode. By default the kernel thread polls every registered
+   process every interval_ms. With sched_accounting=1 the cpu time is
+   instead refreshed from the sched_switch tracepoint, and the thread
+   only charges the processes that are on a CPU and publishes the
+   snapshot. The status file then reports the accumulated runtime, in
+   the same cputime units. Exits are caught by the sched_process_exit
+   tracepoint in both modes */
+static bool sched_accounting;
+module_param(sched_accounting, bool, 0444);
+MODULE_PARM_DESC(sched_accounting,
+		 "Account cpu time at context switch instead of polling");
+
+/* Resolve every entry through its pid on each update pass, as mp1 did
+   before tasks were pinned at registration. Only useful to compare the
+   cost of both with mp1_bench */
+static bool legacy_lookup;
+module_param(legacy_lookup, bool, 0644);
+MODULE_PARM_DESC(legacy_lookup,
+		 "Look each task up by pid on every update pass (benchmarking)");
+
+/* Number of processes reported in /proc/mp1/top */
+#define MP1_MAX_TOP_K 1024
+static unsigned int top_k = 10;
+module_param(top_k, uint, 0444);
+MODULE_PARM_DESC(top_k, "Number of top cpu consumers to track (1-1024)");
+
+/* Capacity of the binary snapshot exported through /dev/mp1, and of one
+   read() on it */
+#define MP1_MAX_SNAPSHOT 65536
+static unsigned int snapshot_max = 4096;
+module_param(snapshot_max, uint, 0444);
+MODULE_PARM_DESC(snapshot_max, "Maximum number of records in the snapshot (1-65536)");
+
+/* Entries kept in reserve so that registration does not depend on the
+   page allocator under memory pressure. 0 disables the reserve */
+static unsigned int entry_reserve;
+module_param(entry_reserve, uint, 0444);
+MODULE_PARM_DESC(entry_reserve, "Number of preallocated registry entries");
+
+/* Number of samples kept per process for /proc/mp1/history. Each costs
+   sizeof(struct mp1_sample) for every registered process */
+#define MP1_MAX_HISTORY 1024
+static unsigned int history_len = 60;
+module_param(history_len, uint, 0444);
+MODULE_PARM_DESC(history_len, "Samples of history per process (0-1024)");
+
+/* Proc dir to be added */
+static struct proc_dir_entry *proc_dir;
+
+/* CPU times of a process in nanoseconds */
+struct mp1_cputime {
+	u64 utime;
+	u64 stime;
+	/* Precise scheduler runtime (se.sum_exec_runtime) */
+	u64 runtime;
+};
+
+/* One update pass sample of a process, times in nanoseconds */
+struct mp1_sample {
+	u64 timestamp;
+	u64 utime;
+	u64 stime;
+};
+
+/* Named group of processes with aggregated cpu accounting */
+#define MP1_GROUP_NAME_LEN 16
+#define MP1_MAX_GROUPS 64
+struct mp1_group {
+	/* In mp1_groups, walked under RCU */
+	struct list_head list;
+	/* For freeing the group after an RCU grace period */
+	struct rcu_head rcu;
+	char name[MP1_GROUP_NAME_LEN];
+	/* Number of registered members, and references held by them and
+	   by registrations in progress. Under mp1_lock. A group and its
+	   totals stay after the last reference is dropped, until it is
+	   removed through /proc/mp1/groups or its slot is reused for a new
+	   group */
+	unsigned int members;
+	unsigned int refs;
+	/* Totals of the members that exited or were unregistered, under
+	   mp1_lock */
+	struct mp1_cputime retired;
+	/* Totals and summed utilization of the live members as of the last
+	   update pass, published under mp1_lock */
+	struct mp1_cputime live;
+	unsigned long util;
+	/* Sums being built by the running update pass, under mp1_lock */
+	struct mp1_cputime work;
+	unsigned long work_util;
+};
+
+/* What one member adds to the sums of its group */
+struct mp1_group_share {
+	struct mp1_cputime times;
+	unsigned long util;
+};
 
 /* Entry to be maintained for each process in a list */
 typedef struct mp1_proc_entry{
 	struct list_head list;
+	/* Chain in the pid hash table */
+	struct list_head hash_list;
+	/* For freeing the entry after an RCU grace period */
+	struct rcu_head rcu;
+	/* Set once the entry is unlinked, under mp1_lock */
+	bool removed;
 	unsigned int pid;
+	/* Pinned from registration until the entry is freed */
+	struct task_struct *task;
 	unsigned long cpu_time;
+	/* Last sampled cpu times and when they were taken (ns) */
+	struct mp1_cputime times;
+	u64 last_update;
+	/* With sched_accounting, CLOCK_MONOTONIC time since which the task
+	   has run without being charged, 0 while it is off the CPU. It,
+	   times and cpu_time are under acct_lock, shared by the
+	   sched_switch probe and the update pass */
+	u64 switched_in;
+	spinlock_t acct_lock;
+	/* Runtime and time of the previous update pass, for rates */
+	u64 prev_runtime;
+	u64 prev_pass;
+	/* Utilization over the last interval and its 1/5/15 interval
+	   moving averages, in percent as MP1_FSHIFT fixed point */
+	unsigned long util;
+	unsigned long avg[3];
+	/* CPU quota: at most budget_ns of runtime per window_ns, no quota
+	   if budget_ns is 0. Over budget, the process is stopped until its
+	   next window. Runtimes are of the whole thread group, which the
+	   signals act on. Under mp1_lock */
+	u64 budget_ns;
+	u64 window_ns;
+	u64 window_start;
+	u64 window_runtime;
+	u64 quota_runtime;
+	bool throttled;
+	unsigned long throttle_events;
+	/* Group given at registration, or NULL */
+	struct mp1_group *group;
+	/* Share added to the group's work sums by the last update pass
+	   that saw the entry and that pass, and the share published in the
+	   live sums before it. Under mp1_lock, for taking the entry back
+	   out of the sums when it leaves */
+	struct mp1_group_share group_work;
+	u64 group_gen;
+	struct mp1_group_share group_live;
+	/* Times last reported to /dev/mp1 readers, when they were taken
+	   and the generation of the update pass that changed them. Only
+	   set by the update pass, readers copy them under reported_seq */
+	seqcount_t reported_seq;
+	struct mp1_cputime reported;
+	u64 reported_update;
+	u64 changed_gen;
+	/* Ring of the last history_len samples, allocated at registration
+	   and written only by the update pass. history_next is the slot to
+	   write next */
+	seqcount_t history_seq;
+	unsigned int history_next;
+	unsigned int history_nr;
+	struct mp1_sample *history;
 }MP1_PROC_ENTRY;
 
-/* List head */
-static MP1_PROC_ENTRY mp1_proc_list;
+/* Fixed point arithmetic for the utilization averages, as for loadavg */
+#define MP1_FSHIFT	11
+#define MP1_FIXED_1	(1 << MP1_FSHIFT)
+#define MP1_INT(x)	((x) >> MP1_FSHIFT)
+#define MP1_FRAC(x)	MP1_INT(((x) & (MP1_FIXED_1 - 1)) * 100)
+
+/* Decay per interval for 1, 5 and 15 interval averages:
+   MP1_FIXED_1 / exp(1 / n) */
+static const unsigned long mp1_avg_exp[3] = { 753, 1677, 1916 };
+
+/* List head */
+static MP1_PROC_ENTRY mp1_proc_list;
+
+/* Hash table of registered processes, keyed by pid */
+#define MP1_HASH_BITS 10
+static struct list_head mp1_hash[1 << MP1_HASH_BITS];
+
+/* Kernel Thread */
+static struct task_struct *mp1_kernel_thread;
+
+/* Wait queue for kernel thread to wait on */
+static DECLARE_WAIT_QUEUE_HEAD (mp1_waitqueue);
+
+/* High resolution timer for waking kernel thread periodically */
+static struct hrtimer mp1_timer;
+
+/* Absolute time of the next sample, so that the period does not drift by
+   the cost of each update pass */
+static ktime_t mp1_next_sample;
+
+/* Cost of the update passes, exported in /proc/mp1/stats */
+static struct mp1_update_stats {
+	u64 passes;
+	u64 last_ns;
+	u64 max_ns;
+	u64 total_ns;
+} mp1_stats;
+
+/* Number of registered processes */
+static unsigned int mp1_nr_entries;
+
+/* Groups, oldest first, and the number of update passes published to
+   them. Under mp1_lock */
+static LIST_HEAD(mp1_groups);
+static unsigned int mp1_nr_groups;
+static u64 mp1_groups_gen;
+
+/* Final cpu times of registered processes that exited. The last
+   MP1_EXIT_LOG_SIZE exits are kept, protected by mp1_lock */
+#define MP1_EXIT_LOG_SIZE 256
+struct mp1_exit_record {
+	unsigned int pid;
+	struct mp1_cputime times;
+};
+static struct mp1_exit_record mp1_exit_log[MP1_EXIT_LOG_SIZE];
+/* Number of exits logged since load */
+static unsigned int mp1_exit_log_count;
+
+/* Top cpu consumers by utilization over the last interval. The update
+   pass builds a min-heap of top_k processes in mp1_top_work, then swaps
+   it with mp1_top under mp1_top_lock */
+struct mp1_top_entry {
+	unsigned int pid;
+	unsigned long util;
+};
+static struct mp1_top_entry *mp1_top, *mp1_top_work;
+static unsigned int mp1_top_nr;
+static DEFINE_SPINLOCK(mp1_top_lock);
+
+/* Binary snapshot of all tracked processes, mmap()ed by /dev/mp1 users.
+   Only the kernel thread writes it */
+static struct mp1_snapshot_header *mp1_snapshot;
+static unsigned long mp1_snapshot_size;
+
+/* Records being returned by a read, shared by all readers and protected
+   by mp1_dev_mutex together with their mp1_dev_reader */
+static struct mp1_record *mp1_dev_buf;
+static DEFINE_MUTEX(mp1_dev_mutex);
+
+/* Update passes completed, and the last one that changed any record.
+   Under mp1_lock */
+static u64 mp1_generation;
+static u64 mp1_changed_generation;
+
+/* Wait queue for /dev/mp1 readers, woken by update passes that changed
+   a record */
+static DECLARE_WAIT_QUEUE_HEAD(mp1_dev_waitqueue);
+
+/* Slab cache for the entries and its optional reserve */
+static struct kmem_cache *mp1_entry_cache;
+static mempool_t *mp1_entry_pool;
+
+/* Lock serializing updates to the list and hash table. Readers only
+   take rcu_read_lock */
+static DEFINE_SPINLOCK(mp1_lock);
+
+/* Func: mp1_timer_callback
+ * Desc: Timer callback to just wake up the kernel thread
+ *
+ */
+static enum hrtimer_restart mp1_timer_callback(struct hrtimer *timer)
+{
+	/* Put the kernel thread into running state */
+	wake_up_interruptible(&mp1_waitqueue);
+
+	/* The thread re-arms the timer after its update pass */
+	return HRTIMER_NORESTART;
+}
+
+/* Func: mp1_start_timer
+ * Desc: Arm the timer for the next sample, one interval after the
+ *       previous one. If we fell behind, restart from now. Caller must
+ *       hold mp1_lock
+ *
+ */
+static void mp1_start_timer(bool first)
+{
+	ktime_t now = ktime_get();
+	u64 interval = (u64)max_t(unsigned int, ACCESS_ONCE(interval_ms),
+				  MP1_MIN_INTERVAL_MS) * NSEC_PER_MSEC;
+
+	if (first) {
+		mp1_next_sample = now;
+	}
+
+	mp1_next_sample = ktime_add_ns(mp1_next_sample, interval);
+
+	/* Missed samples are not replayed */
+	if (ktime_to_ns(mp1_next_sample) <= ktime_to_ns(now)) {
+		mp1_next_sample = ktime_add_ns(now, interval);
+	}
+
+	hrtimer_start(&mp1_timer, mp1_next_sample, HRTIMER_MODE_ABS);
+}
+
+/* Func: mp1_hash_head
+ * Desc: Hash bucket for a pid
+ *
+ */
+static struct list_head *mp1_hash_head(unsigned int pid)
+{
+	return &mp1_hash[hash_32(pid, MP1_HASH_BITS)];
+}
+
+/* Func: mp1_find_entry
+ * Desc: Look up a registered process by pid. Caller must hold either
+ *       rcu_read_lock or mp1_lock
+ *
+ */
+static MP1_PROC_ENTRY *mp1_find_entry(unsigned int pid)
+{
+	MP1_PROC_ENTRY *tmp;
+
+	list_for_each_entry_rcu(tmp, mp1_hash_head(pid), hash_list) {
+		if (tmp->pid == pid) {
+			return tmp;
+		}
+	}
+
+	return NULL;
+}
+
+/* Func: mp1_entry_ctor
+ * Desc: Slab constructor for the entry cache. Entries are handed out
+ *       zeroed: constructed so here, and zeroed again when freed. Having
+ *       a constructor also keeps the cache from being merged with others
+ *       so that it shows in /proc/slabinfo
+ *
+ */
+static void mp1_entry_ctor(void *obj)
+{
+	memset(obj, 0, sizeof(MP1_PROC_ENTRY));
+}
+
+/* Func: mp1_alloc_entry
+ * Desc: Allocate a zeroed entry, from the reserve when the cache cannot
+ *       grow right away. Never waits for entries to be freed, callers
+ *       must not hold mp1_write_mutex either way
+ *
+ */
+static MP1_PROC_ENTRY *mp1_alloc_entry(void)
+{
+	MP1_PROC_ENTRY *tmp;
+
+	if (mp1_entry_pool) {
+		tmp = mempool_alloc(mp1_entry_pool, GFP_NOWAIT);
+		if (tmp) {
+			return tmp;
+		}
+	}
+
+	/* Reserve used up, reclaim like any other allocation */
+	return kmem_cache_alloc(mp1_entry_cache, GFP_KERNEL);
+}
+
+/* Func: mp1_free_entry
+ * Desc: Free the history of an entry and return the entry, zeroed for
+ *       its next user, to the reserve or the cache
+ *
+ */
+static void mp1_free_entry(MP1_PROC_ENTRY *tmp)
+{
+	kfree(tmp->history);
+	memset(tmp, 0, sizeof(*tmp));
+
+	if (mp1_entry_pool) {
+		mempool_free(tmp, mp1_entry_pool);
+	} else {
+		kmem_cache_free(mp1_entry_cache, tmp);
+	}
+}
+
+/* Func: mp1_free_entry_rcu
+ * Desc: Free an entry once no reader can see it anymore
+ *
+ */
+static void mp1_free_entry_rcu(struct rcu_head *head)
+{
+	MP1_PROC_ENTRY *tmp = container_of(head, MP1_PROC_ENTRY, rcu);
+
+	put_task_struct(tmp->task);
+	mp1_free_entry(tmp);
+}
+
+/* Func: mp1_free_group_rcu
+ * Desc: Free a group once no reader can see it anymore
+ *
+ */
+static void mp1_free_group_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct mp1_group, rcu));
+}
+
+/* Func: mp1_put_group
+ * Desc: Drop a reference to a group. The group keeps its totals for
+ *       later reads. Caller must hold mp1_lock
+ *
+ */
+static void mp1_put_group(struct mp1_group *group)
+{
+	group->refs--;
+}
+
+/* Func: mp1_remove_group
+ * Desc: Unlink a group nobody references and free it after a grace
+ *       period. Caller must hold mp1_lock
+ *
+ */
+static void mp1_remove_group(struct mp1_group *group)
+{
+	list_del_rcu(&group->list);
+	mp1_nr_groups--;
+	call_rcu(&group->rcu, mp1_free_group_rcu);
+}
+
+/* Func: mp1_unused_group
+ * Desc: Return the oldest group without members or registrations in
+ *       progress, or NULL. Caller must hold mp1_lock
+ *
+ */
+static struct mp1_group *mp1_unused_group(void)
+{
+	struct mp1_group *group;
+
+	list_for_each_entry(group, &mp1_groups, list) {
+		if (group->refs == 0) {
+			return group;
+		}
+	}
+
+	return NULL;
+}
+
+/* Func: mp1_group_sub
+ * Desc: Take a member's share out of group sums
+ *
+ */
+static void mp1_group_sub(struct mp1_cputime *times, unsigned long *util,
+			  struct mp1_group_share *share)
+{
+	times->utime -= share->times.utime;
+	times->stime -= share->times.stime;
+	times->runtime -= share->times.runtime;
+	*util -= share->util;
+}
+
+/* Func: mp1_del_entry
+ * Desc: Unlink an entry from the list and hash table and free it after
+ *       a grace period. Caller must hold mp1_lock
+ *
+ */
+static void mp1_del_entry(MP1_PROC_ENTRY *tmp)
+{
+	struct mp1_group *group;
+
+	/* Lookups done under RCU only may race with another removal */
+	if (tmp->removed) {
+		return;
+	}
+	tmp->removed = true;
+
+	list_del_rcu(&tmp->list);
+	list_del_rcu(&tmp->hash_list);
+	mp1_nr_entries--;
+
+	/* Its cpu time stays accounted to its group, moved from the live
+	   sums to the retired ones so that it is not counted twice until
+	   the next update pass */
+	if (tmp->group) {
+		group = tmp->group;
+		group->members--;
+		group->retired.utime += tmp->times.utime;
+		group->retired.stime += tmp->times.stime;
+		group->retired.runtime += tmp->times.runtime;
+
+		if (tmp->group_gen == mp1_groups_gen + 1) {
+			/* Seen by the running pass, not published yet */
+			mp1_group_sub(&group->work, &group->work_util,
+				      &tmp->group_work);
+			mp1_group_sub(&group->live, &group->util,
+				      &tmp->group_live);
+		} else if (tmp->group_gen == mp1_groups_gen) {
+			mp1_group_sub(&group->live, &group->util,
+				      &tmp->group_work);
+		}
+
+		mp1_put_group(group);
+	}
+
+	/* Do not leave an unregistered process stopped */
+	if (tmp->throttled) {
+		send_sig(SIGCONT, tmp->task, 1);
+		tmp->throttled = false;
+	}
+	call_rcu(&tmp->rcu, mp1_free_entry_rcu);
+}
+
+/* Func: mp1_seq_start
+ * Desc: Start (or resume) a chunk of the status dump at position pos.
+ *       The RCU read lock is taken here and released in mp1_seq_stop,
+ *       so readers never block registration or the update thread
+ *
+ */
+static void *mp1_seq_start(struct seq_file *m, loff_t *pos)
+{
+	MP1_PROC_ENTRY *tmp;
+	loff_t n = *pos;
+
+	rcu_read_lock();
+
+	/* Skip over the entries already sent in previous chunks */
+	list_for_each_entry_rcu(tmp, &mp1_proc_list.list, list) {
+		if (n-- == 0) {
+			return &tmp->list;
+		}
+	}
+
+	return NULL;
+}
+
+/* Func: mp1_seq_next
+ * Desc: Advance to the next registered process
+ *
+ */
+static void *mp1_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct list_head *next = rcu_dereference(((struct list_head *)v)->next);
+
+	++*pos;
+
+	return (next == &mp1_proc_list.list) ? NULL : next;
+}
+
+/* Func: mp1_seq_stop
+ * Desc: End of a chunk. Drop the RCU read lock taken in mp1_seq_start
+ *
+ */
+static void mp1_seq_stop(struct seq_file *m, void *v)
+{
+	rcu_read_unlock();
+}
+
+/* Func: mp1_seq_show
+ * Desc: Provide pid and cpu time of one registered process to the user
+ *
+ */
+static int mp1_seq_show(struct seq_file *m, void *v)
+{
+	MP1_PROC_ENTRY *tmp = list_entry(v, MP1_PROC_ENTRY, list);
+
+	seq_printf(m, "%u:%lu\n", tmp->pid, tmp->cpu_time);
+
+	return 0;
+}
+
+static const struct seq_operations mp1_seq_ops = {
+	.start = mp1_seq_start,
+	.next  = mp1_seq_next,
+	.stop  = mp1_seq_stop,
+	.show  = mp1_seq_show,
+};
+
+/* Func: mp1_open_proc
+ * Desc: Open the status file as a seq_file so that any number of
+ *       registered processes can be streamed out in chunks
+ *
+ */
+static int mp1_open_proc(struct inode *inode, struct file *filp)
+{
+	return seq_open(filp, &mp1_seq_ops);
+}
+
+/* Func: mp1_read_cputime
+ * Desc: Read user time, system time and scheduler runtime of a task in
+ *       nanoseconds. If group is set, sum them over all threads of the
+ *       task's thread group. Caller must hold rcu_read_lock
+ *
+ */
+static void mp1_read_cputime(struct task_struct *task, bool group,
+			     struct mp1_cputime *times)
+{
+	struct task_struct *t = task;
+
+	times->utime = 0;
+	times->stime = 0;
+	times->runtime = 0;
+
+	do {
+		times->utime += (u64)cputime_to_usecs(t->utime) * NSEC_PER_USEC;
+		times->stime += (u64)cputime_to_usecs(t->stime) * NSEC_PER_USEC;
+		times->runtime += t->se.sum_exec_runtime;
+
+		if (!group) {
+			break;
+		}
+	} while_each_thread(task, t);
+}
+
+/* Func: mp1_charge_runtime
+ * Desc: In sched_accounting mode, add the time a process ran since it was
+ *       switched in or last charged to its runtime. now is CLOCK_MONOTONIC
+ *       in nanoseconds. Caller must hold the entry's acct_lock
+ *
+ */
+static void mp1_charge_runtime(MP1_PROC_ENTRY *tmp, u64 now)
+{
+	if (tmp->switched_in && now > tmp->switched_in) {
+		tmp->times.runtime += now - tmp->switched_in;
+		tmp->switched_in = now;
+	}
+	tmp->cpu_time = nsecs_to_cputime(tmp->times.runtime);
+	tmp->last_update = now;
+}
+
+/* One PID of a batched write and its outcome */
+struct mp1_write_op {
+	unsigned int pid;
+	/* 'R'egister or 'U'nregister */
+	char cmd;
+	/* 0 or -errno */
+	int result;
+	/* Preallocated entry for registrations */
+	MP1_PROC_ENTRY *entry;
+	/* Quota given with "Q" for registrations */
+	bool set_quota;
+	unsigned int budget_ms;
+	unsigned int window_ms;
+	/* Group given with "G" for registrations, name points into the
+	   write buffer */
+	const char *group_name;
+	struct mp1_group *group;
+};
+
+/* Largest write accepted on /proc/mp1/status */
+#define MP1_MAX_WRITE (8 * PAGE_SIZE)
+
+/* Outcome of the last write made through one open /proc/mp1/last_write,
+   read back on the same file so that concurrent writers each see their
+   own. Protected by mp1_write_mutex, which also serializes writers */
+struct mp1_write_results {
+	struct mp1_write_op *ops;
+	int nr;
+};
+static DEFINE_MUTEX(mp1_write_mutex);
+
+/* Func: mp1_next_token
+ * Desc: Return the next whitespace separated token of buf, or NULL
+ *
+ */
+static char *mp1_next_token(char **buf)
+{
+	char *token;
+
+	while ((token = strsep(buf, " \t\n")) != NULL) {
+		/* Skip the empty tokens between consecutive separators */
+		if (*token != '\0') {
+			break;
+		}
+	}
+
+	return token;
+}
+
+/* Func: mp1_parse_write
+ * Desc: Split a write into register/unregister operations. The input is
+ *       a whitespace separated list of PIDs. "R" and "U" switch the
+ *       command for the PIDs that follow, the default is "R", so a plain
+ *       "echo <pid>" still registers. "Q <budget_ms>/<window_ms>" sets a
+ *       cpu quota for the PIDs registered after it, "Q 0" removes it.
+ *       "G <name>" puts the PIDs registered after it in a group, which
+ *       fails with -EEXIST for a PID already registered outside it.
+ *       Returns the number of operations or -EINVAL if a token is not
+ *       understood
+ *
+ */
+static int mp1_parse_write(char *buf, struct mp1_write_op *ops, int max_ops)
+{
+	char *token;
+	char cmd = 'R';
+	bool set_quota = false;
+	unsigned int budget_ms = 0, window_ms = 0;
+	const char *group_name = NULL;
+	int n = 0;
+
+	while ((token = mp1_next_token(&buf)) != NULL) {
+		if (strcmp(token, "R") == 0 || strcmp(token, "U") == 0) {
+			cmd = token[0];
+			continue;
+		}
+
+		if (strcmp(token, "Q") == 0) {
+			token = mp1_next_token(&buf);
+			if (token == NULL) {
+				return -EINVAL;
+			}
+
+			set_quota = true;
+			if (strcmp(token, "0") == 0) {
+				budget_ms = 0;
+				window_ms = 0;
+			} else if (sscanf(token, "%u/%u", &budget_ms,
+					  &window_ms) != 2 ||
+				   budget_ms == 0 || window_ms == 0) {
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		if (strcmp(token, "G") == 0) {
+			group_name = mp1_next_token(&buf);
+			if (group_name == NULL ||
+			    strlen(group_name) >= MP1_GROUP_NAME_LEN) {
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		if (n == max_ops || kstrtouint(token, 10, &ops[n].pid)) {
+			return -EINVAL;
+		}
+
+		ops[n].cmd = cmd;
+		ops[n].result = 0;
+		ops[n].entry = NULL;
+		ops[n].set_quota = set_quota;
+		ops[n].budget_ms = budget_ms;
+		ops[n].window_ms = window_ms;
+		ops[n].group_name = group_name;
+		ops[n].group = NULL;
+		n++;
+	}
+
+	return n;
+}
+
+/* Func: mp1_set_quota
+ * Desc: Set or clear the cpu quota of an entry. The new window starts on
+ *       the next update pass. Caller must hold mp1_lock
+ *
+ */
+static void mp1_set_quota(MP1_PROC_ENTRY *tmp, struct mp1_write_op *op)
+{
+	tmp->budget_ns = (u64)op->budget_ms * NSEC_PER_MSEC;
+	tmp->window_ns = (u64)op->window_ms * NSEC_PER_MSEC;
+	tmp->window_start = 0;
+
+	if (tmp->budget_ns == 0 && tmp->throttled) {
+		send_sig(SIGCONT, tmp->task, 1);
+		tmp->throttled = false;
+	}
+}
+
+/* Func: mp1_get_group
+ * Desc: Find a group by name and take a reference to it, creating it if
+ *       needed. With MP1_MAX_GROUPS groups, the oldest unused one makes
+ *       room. Writers are serialized by mp1_write_mutex, so two writers
+ *       cannot create the same group
+ *
+ */
+static struct mp1_group *mp1_get_group(const char *name)
+{
+	struct mp1_group *group;
+
+	spin_lock(&mp1_lock);
+	list_for_each_entry(group, &mp1_groups, list) {
+		if (strcmp(group->name, name) == 0) {
+			group->refs++;
+			spin_unlock(&mp1_lock);
+			return group;
+		}
+	}
+
+	if (mp1_nr_groups == MP1_MAX_GROUPS && mp1_unused_group() == NULL) {
+		spin_unlock(&mp1_lock);
+		return ERR_PTR(-ENOSPC);
+	}
+	spin_unlock(&mp1_lock);
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (group == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+	strlcpy(group->name, name, sizeof(group->name));
+	group->refs = 1;
+
+	/* Groups only lose references meanwhile, nobody else adds one, so
+	   there is still an unused group if the table is full */
+	spin_lock(&mp1_lock);
+	if (mp1_nr_groups == MP1_MAX_GROUPS) {
+		mp1_remove_group(mp1_unused_group());
+	}
+	list_add_tail_rcu(&group->list, &mp1_groups);
+	mp1_nr_groups++;
+	spin_unlock(&mp1_lock);
+
+	return group;
+}
+
+/* Func: mp1_alloc_write
+ * Desc: Allocate the entries of the PIDs to register and their history
+ *       rings, before taking mp1_write_mutex
+ *
+ */
+static void mp1_alloc_write(struct mp1_write_op *ops, int nr_ops)
+{
+	int i;
+
+	for (i = 0; i < nr_ops; i++) {
+		if (ops[i].cmd != 'R') {
+			continue;
+		}
+
+		if (ops[i].pid == 0) {
+			ops[i].result = -EINVAL;
+			continue;
+		}
+
+		/* Allocate a new list entry, all samples and averages start
+		   at 0 */
+		ops[i].entry = mp1_alloc_entry();
+		if (ops[i].entry == NULL) {
+			ops[i].result = -ENOMEM;
+			continue;
+		}
+
+		if (history_len == 0) {
+			continue;
+		}
+
+		/* Outside the entry cache, so that objects stay small */
+		ops[i].entry->history = kcalloc(history_len,
+						sizeof(struct mp1_sample),
+						GFP_KERNEL);
+		if (ops[i].entry->history == NULL) {
+			mp1_free_entry(ops[i].entry);
+			ops[i].entry = NULL;
+			ops[i].result = -ENOMEM;
+		}
+	}
+}
+
+/* Func: mp1_prepare_write
+ * Desc: Check the PIDs to register and set up their entries, so that the
+ *       locked part of the write does not have to
+ *
+ */
+static void mp1_prepare_write(struct mp1_write_op *ops, int nr_ops)
+{
+	struct task_struct *task;
+	int i;
+
+	for (i = 0; i < nr_ops; i++) {
+		if (ops[i].cmd != 'R') {
+			continue;
+		}
+
+		/* No entry was allocated for it */
+		if (ops[i].result) {
+			continue;
+		}
+
+		/* Find the task and pin it for the lifetime of the entry */
+		rcu_read_lock();
+		task = find_task_by_pid(ops[i].pid);
+		if (task) {
+			get_task_struct(task);
+		}
+		rcu_read_unlock();
+
+		if (task == NULL) {
+			mp1_free_entry(ops[i].entry);
+			ops[i].entry = NULL;
+			ops[i].result = -ESRCH;
+			continue;
+		}
+
+		/* Store the pid and the task */
+		ops[i].entry->pid = ops[i].pid;
+		ops[i].entry->task = task;
+
+		/* Only for a task that exists, so that failed registrations
+		   do not use up groups */
+		if (ops[i].group_name) {
+			ops[i].group = mp1_get_group(ops[i].group_name);
+			if (IS_ERR(ops[i].group)) {
+				ops[i].result = PTR_ERR(ops[i].group);
+				ops[i].group = NULL;
+				continue;
+			}
+		}
+
+		/* Initialize list structures in the entry */
+		INIT_LIST_HEAD(&ops[i].entry->list);
+		seqcount_init(&ops[i].entry->history_seq);
+		seqcount_init(&ops[i].entry->reported_seq);
+		spin_lock_init(&ops[i].entry->acct_lock);
+		INIT_LIST_HEAD(&ops[i].entry->hash_list);
+	}
+}
+
+/* Func: mp1_apply_write
+ * Desc: Apply all operations of a write under one acquisition of
+ *       mp1_lock. Entries that were not used are left in ops for the
+ *       caller to free
+ *
+ */
+static void mp1_apply_write(struct mp1_write_op *ops, int nr_ops)
+{
+	MP1_PROC_ENTRY *tmp;
+	int i;
+
+	/* Enter critical region */
+	spin_lock(&mp1_lock);
+
+	for (i = 0; i < nr_ops; i++) {
+		if (ops[i].result) {
+			continue;
+		}
+
+		tmp = mp1_find_entry(ops[i].pid);
+
+		if (ops[i].cmd == 'U') {
+			if (tmp == NULL) {
+				ops[i].result = -ENOENT;
+			} else {
+				mp1_del_entry(tmp);
+			}
+			continue;
+		}
+
+		/* Already registered? Keep the existing entry, but take the
+		   new quota if one was given. Its group cannot change */
+		if (tmp) {
+			if (ops[i].group && ops[i].group != tmp->group) {
+				ops[i].result = -EEXIST;
+				continue;
+			}
+			if (ops[i].set_quota) {
+				mp1_set_quota(tmp, &ops[i]);
+			}
+			continue;
+		}
+
+		/* The exit tracepoint fires after PF_EXITING is set and takes
+		   mp1_lock, so a task that is not exiting yet is guaranteed to
+		   be seen by it once added */
+		if (ops[i].entry->task->flags & PF_EXITING) {
+			ops[i].result = -ESRCH;
+			continue;
+		}
+
+		/* For the first entry, start the timer */
+		if (list_empty(&mp1_proc_list.list)) {
+			printk(KERN_INFO "mp1:list is empty..starting timer\n");
+			/* Starting timer one interval from now */
+			mp1_start_timer(true);
+		}
+
+		/* Add the entry to the tail of the list and to its hash
+		   bucket */
+		tmp = ops[i].entry;
+		ops[i].entry = NULL;
+		if (ops[i].set_quota) {
+			mp1_set_quota(tmp, &ops[i]);
+		}
+		/* The entry takes over the group reference */
+		tmp->group = ops[i].group;
+		ops[i].group = NULL;
+		if (tmp->group) {
+			tmp->group->members++;
+		}
+		/* Runtime is accumulated at context switches from here on,
+		   starting from what the task has run so far */
+		if (sched_accounting) {
+			mp1_read_cputime(tmp->task, false, &tmp->times);
+			tmp->cpu_time = nsecs_to_cputime(tmp->times.runtime);
+			if (task_curr(tmp->task)) {
+				tmp->switched_in = ktime_to_ns(ktime_get());
+			}
+		}
+		list_add_tail_rcu(&(tmp->list), &(mp1_proc_list.list));
+		list_add_rcu(&(tmp->hash_list), mp1_hash_head(tmp->pid));
+		mp1_nr_entries++;
+	}
+
+	/* Exit critical region */
+	spin_unlock(&mp1_lock);
+}
+
+/* Func: mp1_do_write
+ * Desc: Register and unregister the PIDs sent from user process. See
+ *       mp1_parse_write for the format. All of them are applied under
+ *       one lock acquisition. Registering an already registered pid is a
+ *       no-op. The write fails with the first error if any PID could not
+ *       be handled. The outcome for each PID replaces the one in res if
+ *       given
+ *
+ */
+static ssize_t mp1_do_write(const char __user *buff, size_t len,
+			    struct mp1_write_results *res)
+{
+	struct mp1_write_op *ops;
+	char *buf;
+	int nr_ops, max_ops, i;
+	int err = 0;
+
+	if (len > MP1_MAX_WRITE) {
+		return -E2BIG;
+	}
+
+	/* Copy the pids sent by the user process into kernel buffer */
+	buf = kmalloc(len + 1, GFP_KERNEL);
+	if (buf == NULL) {
+		return -ENOMEM;
+	}
+
+	if (copy_from_user(buf, buff, len)) {
+		kfree(buf);
+		return -EFAULT;
+	}
+	buf[len] = '\0';
+
+	/* A PID takes at least two characters with its separator */
+	max_ops = len / 2 + 1;
+	ops = kcalloc(max_ops, sizeof(*ops), GFP_KERNEL);
+	if (ops == NULL) {
+		kfree(buf);
+		return -ENOMEM;
+	}
+
+	nr_ops = mp1_parse_write(buf, ops, max_ops);
+	if (nr_ops < 0) {
+		kfree(buf);
+		kfree(ops);
+		return nr_ops;
+	}
+
+	mp1_alloc_write(ops, nr_ops);
+
+	mutex_lock(&mp1_write_mutex);
+
+	mp1_prepare_write(ops, nr_ops);
+	mp1_apply_write(ops, nr_ops);
+
+	/* Group names point into buf */
+	kfree(buf);
+
+	for (i = 0; i < nr_ops; i++) {
+		/* Free entries that were not added */
+		if (ops[i].entry) {
+			put_task_struct(ops[i].entry->task);
+			mp1_free_entry(ops[i].entry);
+			ops[i].entry = NULL;
+		}
+		/* And drop the groups they would have joined */
+		if (ops[i].group) {
+			spin_lock(&mp1_lock);
+			mp1_put_group(ops[i].group);
+			spin_unlock(&mp1_lock);
+			ops[i].group = NULL;
+		}
+		ops[i].group_name = NULL;
+
+		if (ops[i].result) {
+			printk(KERN_INFO "mp1:%c %u failed:%d\n",
+			       ops[i].cmd, ops[i].pid, ops[i].result);
+			if (err == 0) {
+				err = ops[i].result;
+			}
+		}
+	}
+
+	/* Keep the outcome for the writer */
+	if (res) {
+		kfree(res->ops);
+		res->ops = ops;
+		res->nr = nr_ops;
+	} else {
+		kfree(ops);
+	}
+
+	mutex_unlock(&mp1_write_mutex);
+
+	return err ? err : len;
+}
+
+/* Func: mp1_write_proc
+ * Desc: Write handler of the status file
+ *
+ */
+ssize_t mp1_write_proc(struct file *filp, const char __user *buff,
+		       size_t len, loff_t *off)
+{
+	return mp1_do_write(buff, len, NULL);
+}
+
+/* Func: mp1_last_write_show
+ * Desc: Show the outcome of each PID of the last write made through this
+ *       file as pid:command:result
+ *
+ */
+static int mp1_last_write_show(struct seq_file *m, void *v)
+{
+	struct mp1_write_results *res = m->private;
+	int i;
+
+	mutex_lock(&mp1_write_mutex);
+	for (i = 0; i < res->nr; i++) {
+		seq_printf(m, "%u:%c:%d\n", res->ops[i].pid,
+			   res->ops[i].cmd, res->ops[i].result);
+	}
+	mutex_unlock(&mp1_write_mutex);
+
+	return 0;
+}
+
+/* Func: mp1_write_last_write
+ * Desc: Same commands as the status file, keeping their outcome for
+ *       reads of this open file
+ *
+ */
+static ssize_t mp1_write_last_write(struct file *filp,
+				    const char __user *buff,
+				    size_t len, loff_t *off)
+{
+	struct seq_file *m = filp->private_data;
+
+	return mp1_do_write(buff, len, m->private);
+}
+
+static int mp1_open_last_write(struct inode *inode, struct file *filp)
+{
+	struct mp1_write_results *res;
+	int ret;
+
+	res = kzalloc(sizeof(*res), GFP_KERNEL);
+	if (res == NULL) {
+		return -ENOMEM;
+	}
+
+	ret = single_open(filp, mp1_last_write_show, res);
+	if (ret) {
+		kfree(res);
+	}
+
+	return ret;
+}
+
+static int mp1_release_last_write(struct inode *inode, struct file *filp)
+{
+	struct seq_file *m = filp->private_data;
+	struct mp1_write_results *res = m->private;
+
+	kfree(res->ops);
+	kfree(res);
+
+	return single_release(inode, filp);
+}
+
+/* File operations for /proc/mp1/last_write */
+static const struct file_operations mp1_last_write_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp1_open_last_write,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = mp1_release_last_write,
+	.write   = mp1_write_last_write,
+};
+
+/* File operations for /proc/mp1/status */
+static const struct file_operations mp1_proc_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp1_open_proc,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release,
+	.write   = mp1_write_proc,
+};
+
+/* Func: mp1_cputime_show_common
+ * Desc: Print nanosecond cpu times of one registered process, either of
+ *       the registered thread alone or of its whole thread group
+ *
+ */
+static int mp1_cputime_show_common(struct seq_file *m, void *v, bool group)
+{
+	MP1_PROC_ENTRY *tmp = list_entry(v, MP1_PROC_ENTRY, list);
+	struct mp1_cputime times;
+
+	/* Exiting, its thread list can no longer be walked. The entry goes
+	   away from the exit tracepoint */
+	if (!pid_alive(tmp->task)) {
+		return 0;
+	}
+
+	/* mp1_seq_start already holds rcu_read_lock */
+	mp1_read_cputime(tmp->task, group, &times);
+
+	seq_printf(m, "%u:%llu:%llu:%llu\n", tmp->pid,
+		   times.utime, times.stime, times.runtime);
+
+	return 0;
+}
+
+/* Func: mp1_cputime_show
+ * Desc: Per thread line of /proc/mp1/cputime
+ *
+ */
+static int mp1_cputime_show(struct seq_file *m, void *v)
+{
+	return mp1_cputime_show_common(m, v, false);
+}
+
+/* Func: mp1_cputime_tg_show
+ * Desc: Per thread group line of /proc/mp1/cputime_tg
+ *
+ */
+static int mp1_cputime_tg_show(struct seq_file *m, void *v)
+{
+	return mp1_cputime_show_common(m, v, true);
+}
+
+static const struct seq_operations mp1_cputime_seq_ops = {
+	.start = mp1_seq_start,
+	.next  = mp1_seq_next,
+	.stop  = mp1_seq_stop,
+	.show  = mp1_cputime_show,
+};
+
+static const struct seq_operations mp1_cputime_tg_seq_ops = {
+	.start = mp1_seq_start,
+	.next  = mp1_seq_next,
+	.stop  = mp1_seq_stop,
+	.show  = mp1_cputime_tg_show,
+};
+
+static int mp1_open_cputime(struct inode *inode, struct file *filp)
+{
+	return seq_open(filp, &mp1_cputime_seq_ops);
+}
+
+static int mp1_open_cputime_tg(struct inode *inode, struct file *filp)
+{
+	return seq_open(filp, &mp1_cputime_tg_seq_ops);
+}
+
+/* File operations for /proc/mp1/cputime and /proc/mp1/cputime_tg */
+static const struct file_operations mp1_cputime_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp1_open_cputime,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release,
+};
+
+static const struct file_operations mp1_cputime_tg_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp1_open_cputime_tg,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release,
+};
+
+/* Func: mp1_load_show
+ * Desc: Print the utilization of one registered process over the last
+ *       interval and its 1/5/15 interval moving averages, in percent
+ *
+ */
+static int mp1_load_show(struct seq_file *m, void *v)
+{
+	MP1_PROC_ENTRY *tmp = list_entry(v, MP1_PROC_ENTRY, list);
+
+	seq_printf(m, "%u:%lu.%02lu:%lu.%02lu:%lu.%02lu:%lu.%02lu\n",
+		   tmp->pid,
+		   MP1_INT(tmp->util), MP1_FRAC(tmp->util),
+		   MP1_INT(tmp->avg[0]), MP1_FRAC(tmp->avg[0]),
+		   MP1_INT(tmp->avg[1]), MP1_FRAC(tmp->avg[1]),
+		   MP1_INT(tmp->avg[2]), MP1_FRAC(tmp->avg[2]));
+
+	return 0;
+}
+
+static const struct seq_operations mp1_load_seq_ops = {
+	.start = mp1_seq_start,
+	.next  = mp1_seq_next,
+	.stop  = mp1_seq_stop,
+	.show  = mp1_load_show,
+};
+
+static int mp1_open_load(struct inode *inode, struct file *filp)
+{
+	return seq_open(filp, &mp1_load_seq_ops);
+}
+
+/* File operations for /proc/mp1/load */
+static const struct file_operations mp1_load_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp1_open_load,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release,
+};
+
+/* Func: mp1_quota_show
+ * Desc: Print the quota of a registered process that has one, as
+ *       pid:budget_ms:window_ms:used_ms:throttled:throttle_events where
+ *       used_ms is the runtime in the current window
+ *
+ */
+static int mp1_quota_show(struct seq_file *m, void *v)
+{
+	MP1_PROC_ENTRY *tmp = list_entry(v, MP1_PROC_ENTRY, list);
+	u64 budget_ns, window_ns, used = 0;
+	unsigned long throttle_events;
+	bool throttled;
+
+	/* Take a consistent copy */
+	spin_lock(&mp1_lock);
+	budget_ns = tmp->budget_ns;
+	window_ns = tmp->window_ns;
+	if (tmp->window_start) {
+		used = tmp->quota_runtime - tmp->window_runtime;
+	}
+	throttled = tmp->throttled;
+	throttle_events = tmp->throttle_events;
+	spin_unlock(&mp1_lock);
+
+	if (budget_ns == 0) {
+		return 0;
+	}
+
+	seq_printf(m, "%u:%llu:%llu:%llu:%d:%lu\n", tmp->pid,
+		   div64_u64(budget_ns, NSEC_PER_MSEC),
+		   div64_u64(window_ns, NSEC_PER_MSEC),
+		   div64_u64(used, NSEC_PER_MSEC),
+		   throttled, throttle_events);
+
+	return 0;
+}
+
+static const struct seq_operations mp1_quota_seq_ops = {
+	.start = mp1_seq_start,
+	.next  = mp1_seq_next,
+	.stop  = mp1_seq_stop,
+	.show  = mp1_quota_show,
+};
+
+static int mp1_open_quota(struct inode *inode, struct file *filp)
+{
+	return seq_open(filp, &mp1_quota_seq_ops);
+}
+
+/* File operations for /proc/mp1/quota */
+static const struct file_operations mp1_quota_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp1_open_quota,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release,
+};
+
+/* Func: mp1_top_cmp
+ * Desc: Order top entries by decreasing utilization
+ *
+ */
+static int mp1_top_cmp(const void *a, const void *b)
+{
+	const struct mp1_top_entry *x = a, *y = b;
+
+	if (x->util == y->util) {
+		return 0;
+	}
+
+	return (x->util > y->util) ? -1 : 1;
+}
+
+/* Func: mp1_top_show
+ * Desc: Print the top cpu consumers of the last interval, highest first,
+ *       as pid:util in percent
+ *
+ */
+static int mp1_top_show(struct seq_file *m, void *v)
+{
+	struct mp1_top_entry *top;
+	unsigned int nr, i;
+
+	top = kcalloc(top_k, sizeof(*top), GFP_KERNEL);
+	if (top == NULL) {
+		return -ENOMEM;
+	}
+
+	spin_lock(&mp1_top_lock);
+	nr = mp1_top_nr;
+	memcpy(top, mp1_top, nr * sizeof(*top));
+	spin_unlock(&mp1_top_lock);
+
+	/* The heap is only partially ordered */
+	sort(top, nr, sizeof(*top), mp1_top_cmp, NULL);
+
+	for (i = 0; i < nr; i++) {
+		seq_printf(m, "%u:%lu.%02lu\n", top[i].pid,
+			   MP1_INT(top[i].util), MP1_FRAC(top[i].util));
+	}
+
+	kfree(top);
+
+	return 0;
+}
+
+static int mp1_open_top(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, mp1_top_show, NULL);
+}
+
+/* File operations for /proc/mp1/top */
+static const struct file_operations mp1_top_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp1_open_top,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* Func: mp1_groups_show
+ * Desc: Print every group as name:members:utime:stime:runtime:util,
+ *       with times in nanoseconds including members that are gone and
+ *       util the summed utilization of the live members in percent.
+ *       Costs O(groups), not O(processes)
+ *
+ */
+static int mp1_groups_show(struct seq_file *m, void *v)
+{
+	struct mp1_group *group;
+	struct mp1_cputime total;
+	unsigned int members;
+	unsigned long util;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(group, &mp1_groups, list) {
+		/* Take a consistent copy */
+		spin_lock(&mp1_lock);
+		members = group->members;
+		util = group->util;
+		total.utime = group->live.utime + group->retired.utime;
+		total.stime = group->live.stime + group->retired.stime;
+		total.runtime = group->live.runtime + group->retired.runtime;
+		spin_unlock(&mp1_lock);
+
+		seq_printf(m, "%s:%u:%llu:%llu:%llu:%lu.%02lu\n",
+			   group->name, members,
+			   total.utime, total.stime, total.runtime,
+			   MP1_INT(util), MP1_FRAC(util));
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+static int mp1_open_groups(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, mp1_groups_show, NULL);
+}
+
+/* Func: mp1_write_groups
+ * Desc: "D <name>" removes a group and its totals. Fails with -EBUSY
+ *       while it has members and -ENOENT if there is no such group
+ *
+ */
+static ssize_t mp1_write_groups(struct file *filp, const char __user *buff,
+				size_t len, loff_t *off)
+{
+	char buf[MP1_GROUP_NAME_LEN + 4];
+	struct mp1_group *group;
+	char *name;
+	int ret = -ENOENT;
+
+	if (len >= sizeof(buf)) {
+		return -EINVAL;
+	}
+	if (copy_from_user(buf, buff, len)) {
+		return -EFAULT;
+	}
+	buf[len] = '\0';
+
+	if (strncmp(buf, "D ", 2) != 0) {
+		return -EINVAL;
+	}
+	name = strim(buf + 2);
+
+	/* Keep registrations from taking the group meanwhile */
+	mutex_lock(&mp1_write_mutex);
+	spin_lock(&mp1_lock);
+	list_for_each_entry(group, &mp1_groups, list) {
+		if (strcmp(group->name, name) == 0) {
+			if (group->refs) {
+				ret = -EBUSY;
+			} else {
+				mp1_remove_group(group);
+				ret = 0;
+			}
+			break;
+		}
+	}
+	spin_unlock(&mp1_lock);
+	mutex_unlock(&mp1_write_mutex);
+
+	return ret ? ret : len;
+}
+
+/* File operations for /proc/mp1/groups */
+static const struct file_operations mp1_groups_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp1_open_groups,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+	.write   = mp1_write_groups,
+};
+
+/* Func: mp1_stats_show
+ * Desc: Show the sampling interval and the cost of the update passes
+ *
+ */
+static int mp1_stats_show(struct seq_file *m, void *v)
+{
+	struct mp1_update_stats stats;
+	unsigned int entries;
+
+	/* Take a consistent copy */
+	spin_lock(&mp1_lock);
+	stats = mp1_stats;
+	entries = mp1_nr_entries;
+	spin_unlock(&mp1_lock);
+
+	seq_printf(m, "interval_ms:%u\n", interval_ms);
+	seq_printf(m, "entries:%u\n", entries);
+	seq_printf(m, "passes:%llu\n", stats.passes);
+	seq_printf(m, "last_pass_ns:%llu\n", stats.last_ns);
+	seq_printf(m, "avg_pass_ns:%llu\n",
+		   stats.passes ? div64_u64(stats.total_ns, stats.passes) : 0);
+	seq_printf(m, "max_pass_ns:%llu\n", stats.max_ns);
+
+	return 0;
+}
+
+static int mp1_open_stats(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, mp1_stats_show, NULL);
+}
+
+/* Func: mp1_write_stats
+ * Desc: Any write resets the update pass statistics
+ *
+ */
+static ssize_t mp1_write_stats(struct file *filp, const char __user *buff,
+			       size_t len, loff_t *off)
+{
+	spin_lock(&mp1_lock);
+	memset(&mp1_stats, 0, sizeof(mp1_stats));
+	spin_unlock(&mp1_lock);
+
+	return len;
+}
+
+/* File operations for /proc/mp1/stats */
+static const struct file_operations mp1_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp1_open_stats,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+	.write   = mp1_write_stats,
+};
+
+/* Func: mp1_history_show
+ * Desc: Print the history of the PID written to this open file as
+ *       timestamp:utime:stime lines, oldest first, times in nanoseconds
+ *
+ */
+static int mp1_history_show(struct seq_file *m, void *v)
+{
+	unsigned int pid = (unsigned long)m->private;
+	struct mp1_sample *copy;
+	MP1_PROC_ENTRY *tmp;
+	unsigned int seq, first, nr, i;
+	int ret = 0;
+
+	if (pid == 0 || history_len == 0) {
+		return 0;
+	}
+
+	copy = kcalloc(history_len, sizeof(*copy), GFP_KERNEL);
+	if (copy == NULL) {
+		return -ENOMEM;
+	}
+
+	/* Copy the ring, retrying if the update pass wrote to it */
+	rcu_read_lock();
+	tmp = mp1_find_entry(pid);
+	if (tmp == NULL) {
+		ret = -ESRCH;
+	} else {
+		do {
+			seq = read_seqcount_begin(&tmp->history_seq);
+			nr = tmp->history_nr;
+			first = (tmp->history_next + history_len - nr) %
+				history_len;
+			for (i = 0; i < nr; i++) {
+				copy[i] = tmp->history[(first + i) % history_len];
+			}
+		} while (read_seqcount_retry(&tmp->history_seq, seq));
+	}
+	rcu_read_unlock();
+
+	if (ret == 0) {
+		for (i = 0; i < nr; i++) {
+			seq_printf(m, "%llu:%llu:%llu\n", copy[i].timestamp,
+				   copy[i].utime, copy[i].stime);
+		}
+	}
+
+	kfree(copy);
+	return ret;
+}
+
+static int mp1_open_history(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, mp1_history_show, NULL);
+}
+
+/* Func: mp1_write_history
+ * Desc: Select the PID whose history later reads of this open file
+ *       return. Reads start over from the beginning
+ *
+ */
+static ssize_t mp1_write_history(struct file *filp, const char __user *buff,
+				 size_t len, loff_t *off)
+{
+	struct seq_file *m = filp->private_data;
+	unsigned int pid;
+	int ret;
+
+	ret = kstrtouint_from_user(buff, len, 10, &pid);
+	if (ret) {
+		return ret;
+	}
+
+	m->private = (void *)(unsigned long)pid;
+	*off = 0;
+	return len;
+}
+
+/* File operations for /proc/mp1/history */
+static const struct file_operations mp1_history_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp1_open_history,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+	.write   = mp1_write_history,
+};
+
+/* Func: mp1_update_load
+ * Desc: Compute the utilization of an entry since the previous update
+ *       pass and fold it into its moving averages
+ *
+ */
+static void mp1_update_load(MP1_PROC_ENTRY *tmp, u64 now)
+{
+	u64 elapsed, ran;
+	int i;
+
+	/* First pass since registration, only take the reference point */
+	if (tmp->prev_pass == 0) {
+		tmp->prev_pass = now;
+		tmp->prev_runtime = tmp->times.runtime;
+		return;
+	}
+
+	elapsed = now - tmp->prev_pass;
+	if (elapsed == 0) {
+		return;
+	}
+
+	ran = tmp->times.runtime - tmp->prev_runtime;
+	tmp->util = (unsigned long)div64_u64(ran * 100 * MP1_FIXED_1, elapsed);
+
+	for (i = 0; i < 3; i++) {
+		tmp->avg[i] = (tmp->avg[i] * mp1_avg_exp[i] +
+			       tmp->util * (MP1_FIXED_1 - mp1_avg_exp[i]))
+			>> MP1_FSHIFT;
+	}
+
+	tmp->prev_pass = now;
+	tmp->prev_runtime = tmp->times.runtime;
+}
+
+/* Func: mp1_enforce_quota
+ * Desc: Stop a process that used more than its budget in the current
+ *       window, and let it continue when the next window starts.
+ *       Called from the update pass, so the enforcement granularity is
+ *       the sampling interval
+ *
+ */
+static void mp1_enforce_quota(MP1_PROC_ENTRY *tmp, u64 now)
+{
+	struct mp1_cputime tg;
+
+	/* Checked again under the lock */
+	if (tmp->budget_ns == 0) {
+		return;
+	}
+
+	/* Exiting, its thread list can no longer be walked */
+	if (!pid_alive(tmp->task)) {
+		return;
+	}
+
+	/* Stopping acts on all threads, so charge all of them. The update
+	   pass holds rcu_read_lock */
+	mp1_read_cputime(tmp->task, true, &tg);
+
+	/* Quota state is shared with unregistration and quota updates, so
+	   a removed entry is never stopped again */
+	spin_lock(&mp1_lock);
+
+	if (tmp->removed || tmp->budget_ns == 0) {
+		spin_unlock(&mp1_lock);
+		return;
+	}
+
+	tmp->quota_runtime = tg.runtime;
+
+	if (tmp->window_start == 0 ||
+	    now - tmp->window_start >= tmp->window_ns) {
+		/* Start a new window */
+		tmp->window_start = now;
+		tmp->window_runtime = tg.runtime;
+
+		if (tmp->throttled) {
+			send_sig(SIGCONT, tmp->task, 1);
+			tmp->throttled = false;
+		}
+	} else if (!tmp->throttled &&
+		   tg.runtime - tmp->window_runtime > tmp->budget_ns) {
+		send_sig(SIGSTOP, tmp->task, 1);
+		tmp->throttled = true;
+		tmp->throttle_events++;
+	}
+
+	spin_unlock(&mp1_lock);
+}
+
+/* Func: mp1_top_sift_down
+ * Desc: Restore the min-heap property below slot i
+ *
+ */
+static void mp1_top_sift_down(struct mp1_top_entry *heap, unsigned int nr,
+			      unsigned int i)
+{
+	struct mp1_top_entry tmp;
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < nr) {
+		if (child + 1 < nr && heap[child + 1].util < heap[child].util) {
+			child++;
+		}
+		if (heap[i].util <= heap[child].util) {
+			break;
+		}
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/* Func: mp1_top_add
+ * Desc: Offer a process to the top_k min-heap. The root is the smallest
+ *       of the current top, so most processes are rejected in O(1)
+ *
+ */
+static void mp1_top_add(unsigned int *nr, unsigned int pid, unsigned long util)
+{
+	struct mp1_top_entry *heap = mp1_top_work;
+	struct mp1_top_entry tmp;
+	unsigned int i, parent;
+
+	if (*nr < top_k) {
+		/* Not full yet, append and sift up */
+		i = (*nr)++;
+		heap[i].pid = pid;
+		heap[i].util = util;
+
+		while (i > 0) {
+			parent = (i - 1) / 2;
+			if (heap[parent].util <= heap[i].util) {
+				break;
+			}
+			tmp = heap[i];
+			heap[i] = heap[parent];
+			heap[parent] = tmp;
+			i = parent;
+		}
+	} else if (util > heap[0].util) {
+		/* Replace the smallest of the top */
+		heap[0].pid = pid;
+		heap[0].util = util;
+		mp1_top_sift_down(heap, *nr, 0);
+	}
+}
+
+/* Func: mp1_top_publish
+ * Desc: Make the heap built by this pass the one readers see
+ *
+ */
+static void mp1_top_publish(unsigned int nr)
+{
+	struct mp1_top_entry *swap;
+
+	spin_lock(&mp1_top_lock);
+	swap = mp1_top;
+	mp1_top = mp1_top_work;
+	mp1_top_nr = nr;
+	spin_unlock(&mp1_top_lock);
+
+	mp1_top_work = swap;
+}
+
+/* Func: mp1_group_add
+ * Desc: Add an entry to the work sums of its group for the running
+ *       update pass, remembering its share in case it leaves
+ *
+ */
+static void mp1_group_add(MP1_PROC_ENTRY *tmp)
+{
+	struct mp1_group *group = tmp->group;
+
+	spin_lock(&mp1_lock);
+
+	/* Already retired from the group */
+	if (tmp->removed) {
+		spin_unlock(&mp1_lock);
+		return;
+	}
+
+	/* Its share in the live sums until this pass is published */
+	if (tmp->group_gen == mp1_groups_gen) {
+		tmp->group_live = tmp->group_work;
+	} else {
+		memset(&tmp->group_live, 0, sizeof(tmp->group_live));
+	}
+
+	tmp->group_work.times = tmp->times;
+	tmp->group_work.util = tmp->util;
+	tmp->group_gen = mp1_groups_gen + 1;
+
+	group->work.utime += tmp->times.utime;
+	group->work.stime += tmp->times.stime;
+	group->work.runtime += tmp->times.runtime;
+	group->work_util += tmp->util;
+
+	spin_unlock(&mp1_lock);
+}
+
+/* Func: mp1_groups_publish
+ * Desc: Publish the group sums built by an update pass and clear them
+ *       for the next one
+ *
+ */
+static void mp1_groups_publish(void)
+{
+	struct mp1_group *group;
+
+	spin_lock(&mp1_lock);
+	list_for_each_entry(group, &mp1_groups, list) {
+		group->live = group->work;
+		group->util = group->work_util;
+		memset(&group->work, 0, sizeof(group->work));
+		group->work_util = 0;
+	}
+	mp1_groups_gen++;
+	spin_unlock(&mp1_lock);
+}
+
+/* Func: mp1_add_history
+ * Desc: Append the current sample of an entry to its history ring,
+ *       overwriting the oldest one when full
+ *
+ */
+static void mp1_add_history(MP1_PROC_ENTRY *tmp, u64 now)
+{
+	struct mp1_sample *sample;
+
+	if (history_len == 0) {
+		return;
+	}
+
+	write_seqcount_begin(&tmp->history_seq);
+
+	sample = &tmp->history[tmp->history_next];
+	sample->timestamp = now;
+	sample->utime = tmp->times.utime;
+	sample->stime = tmp->times.stime;
+
+	tmp->history_next = (tmp->history_next + 1) % history_len;
+	if (tmp->history_nr < history_len) {
+		tmp->history_nr++;
+	}
+
+	write_seqcount_end(&tmp->history_seq);
+}
+
+/* Func: mp1_update_pass
+ * Desc: Update the cpu time of every registered process and rewrite the
+ *       binary snapshot. In sched_accounting mode the tracepoints keep
+ *       the entries current and the pass only publishes them. Exited
+ *       processes are removed by the exit tracepoint, not here.
+ *       Returns true if any process has new cpu times
+ *
+ */
+static bool mp1_update_pass(void)
+{
+	MP1_PROC_ENTRY *tmp;
+	struct task_struct *task;
+	struct mp1_record *rec;
+	unsigned int n = 0, registered = 0, top_nr = 0;
+	u64 now = ktime_to_ns(ktime_get());
+	/* Only this thread changes mp1_generation */
+	u64 gen = mp1_generation + 1;
+	bool changed = false;
+	unsigned long flags;
+
+	rec = (struct mp1_record *)((char *)mp1_snapshot +
+				    mp1_snapshot->records_offset);
+
+	/* Readers retry while seq is odd */
+	mp1_snapshot->seq++;
+	smp_wmb();
+
+	/* Traverse the list and update the cpu time for each registered
+	   process straight from its pinned task */
+	rcu_read_lock();
+	list_for_each_entry_rcu(tmp, &mp1_proc_list.list, list) {
+		if (!sched_accounting) {
+			task = tmp->task;
+
+			/* The old way, for comparison. Still under
+			   rcu_read_lock. Only the lookup differs, the rest
+			   of the pass does the same work */
+			if (legacy_lookup) {
+				task = find_task_by_pid(tmp->pid);
+			}
+
+			if (task) {
+				tmp->cpu_time = task->utime;
+				mp1_read_cputime(task, false, &tmp->times);
+				tmp->last_update = now;
+			}
+		} else {
+			/* A task that keeps the CPU is only charged at its
+			   next switch otherwise */
+			spin_lock_irqsave(&tmp->acct_lock, flags);
+			if (tmp->switched_in) {
+				mp1_charge_runtime(tmp, now);
+			}
+			spin_unlock_irqrestore(&tmp->acct_lock, flags);
+		}
+
+		mp1_add_history(tmp, now);
+		mp1_update_load(tmp, now);
+		mp1_enforce_quota(tmp, now);
+		mp1_top_add(&top_nr, tmp->pid, tmp->util);
 
-/* Kernel Thread */
-static struct task_struct *mp1_kernel_thread;
+		if (tmp->group) {
+			mp1_group_add(tmp);
+		}
 
-/* Wait queue for kernel thread to wait on */
-static DECLARE_WAIT_QUEUE_HEAD (mp1_waitqueue);
+		/* Mark what /dev/mp1 readers have not seen yet */
+		if (tmp->changed_gen == 0 ||
+		    memcmp(&tmp->reported, &tmp->times, sizeof(tmp->times))) {
+			write_seqcount_begin(&tmp->reported_seq);
+			tmp->reported = tmp->times;
+			tmp->reported_update = tmp->last_update;
+			tmp->changed_gen = gen;
+			write_seqcount_end(&tmp->reported_seq);
+			changed = true;
+		}
 
-/* Timer for waking kernel thread periodically */
-static struct timer_list mp1_timer;
+		registered++;
+		if (n < mp1_snapshot->max_records) {
+			rec[n].pid = tmp->pid;
+			rec[n].utime = tmp->times.utime;
+			rec[n].stime = tmp->times.stime;
+			rec[n].runtime_ns = tmp->times.runtime;
+			rec[n].last_update = tmp->last_update;
+			n++;
+		}
+	}
+	rcu_read_unlock();
 
-/* Semaphore for synchronization on the list */
-static struct semaphore mp1_sem;
+	mp1_top_publish(top_nr);
+	mp1_groups_publish();
 
-/* Func: mp1_timer_callback
- * Desc: Timer callback to just wake up the kernel thread
+	mp1_snapshot->nr_records = n;
+	mp1_snapshot->nr_registered = registered;
+	mp1_snapshot->timestamp = now;
+
+	smp_wmb();
+	mp1_snapshot->seq++;
+
+	return changed;
+}
+
+/* Func: mp1_alloc_snapshot
+ * Desc: Allocate the snapshot area: one header page followed by the
+ *       records array
  *
  */
-void mp1_timer_callback(unsigned long data)
+static int mp1_alloc_snapshot(void)
 {
-	/* Put the kernel thread into running state */
-	wake_up_interruptible(&mp1_waitqueue);
+	mp1_snapshot_size = PAGE_ALIGN(MP1_SNAPSHOT_SIZE(snapshot_max));
+
+	/* Zeroed and suitable for remap_vmalloc_range */
+	mp1_snapshot = vmalloc_user(mp1_snapshot_size);
+	if (mp1_snapshot == NULL) {
+		return -ENOMEM;
+	}
+
+	/* Room for one read() on /dev/mp1 */
+	mp1_dev_buf = vmalloc(snapshot_max * sizeof(struct mp1_record));
+	if (mp1_dev_buf == NULL) {
+		vfree(mp1_snapshot);
+		return -ENOMEM;
+	}
+
+	mp1_snapshot->max_records = snapshot_max;
+	mp1_snapshot->record_size = sizeof(struct mp1_record);
+	mp1_snapshot->records_offset = MP1_SNAPSHOT_PAGE_SIZE;
+
+	return 0;
 }
 
-/* Func: mp1_read_proc
- * Desc: Read the list and provide pid and cpu time of each registered
- *       process to the user
+/* Func: mp1_dev_mmap
+ * Desc: Map the snapshot read-only into the caller's address space
  *
  */
-int mp1_read_proc(char *page, char **start, off_t off,
-		  int count, int *eof, void *data)
+static int mp1_dev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	int len = 0;
-	MP1_PROC_ENTRY *tmp;
-
-	/* Enter critical region */
-	if (down_interruptible(&mp1_sem)) {
-		printk(KERN_INFO "mp1:unable to obtain sem\n");
-		return 0;
+	/* Only the module writes the snapshot */
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
 	}
+	/* Nor can it be made writable later with mprotect */
+	vma->vm_flags &= ~VM_MAYWRITE;
 
-	/* Traverse the list and put values into page */
-	list_for_each_entry(tmp, &mp1_proc_list.list, list) {
-		len += sprintf(page+len, "%u:%lu\n",tmp->pid, tmp->cpu_time);
-	}
+	return remap_vmalloc_range(vma, mp1_snapshot, vma->vm_pgoff);
+}
 
-	/* Exit critical region */
-	up(&mp1_sem);
+/* Per open file state of /dev/mp1 readers. Records of one update pass
+   are handed out over as many reads as needed */
+struct mp1_dev_reader {
+	/* Last generation fully returned, the generation being returned
+	   and how many of its records were returned already */
+	u64 last_gen;
+	u64 cur_gen;
+	unsigned int pos;
+};
 
-	/* Return length of data being sent */
-	return len;
+/* Func: mp1_dev_ready
+ * Desc: Check whether an update pass changed records since the reader
+ *       last collected them
+ *
+ */
+static bool mp1_dev_ready(struct mp1_dev_reader *r)
+{
+	bool ready;
+
+	spin_lock(&mp1_lock);
+	ready = mp1_changed_generation > r->last_gen;
+	spin_unlock(&mp1_lock);
+
+	return ready;
 }
 
-/* Func: mp1_write_proc
- * Desc: Copy the pid sent from user process and make a new entry in the
- *       list
+/* Func: mp1_dev_collect
+ * Desc: Copy up to max records changed since the reader's last generation
+ *       into mp1_dev_buf, after the ones it was given already. A
+ *       generation that does not fit is continued on the next call,
+ *       which may then miss or repeat records that changed or went away
+ *       in between. Caller must hold mp1_dev_mutex
  *
  */
-int mp1_write_proc(struct file *filp, const char __user *buff,
-		   unsigned long len, void *data)
+static unsigned int mp1_dev_collect(struct mp1_dev_reader *r,
+				    unsigned int max)
 {
-#define PID_LEN 8
-	char pid_str[PID_LEN];
 	MP1_PROC_ENTRY *tmp;
-	int ret;
+	struct mp1_record rec;
+	unsigned int seq, skip = r->pos, nr = 0;
+	u64 changed_gen;
+	bool more = false;
 
-	if (len > PID_LEN) {
-		len = PID_LEN;
+	/* Starting a generation */
+	if (r->pos == 0) {
+		spin_lock(&mp1_lock);
+		r->cur_gen = mp1_generation;
+		spin_unlock(&mp1_lock);
 	}
 
-	/* Copy the pid sent by the user process into kernel buffer */
-	if (copy_from_user(pid_str, buff, len)) {
-		return -EFAULT;
+	rec.pad = 0;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(tmp, &mp1_proc_list.list, list) {
+		/* The update pass may be rewriting them */
+		do {
+			seq = read_seqcount_begin(&tmp->reported_seq);
+			changed_gen = tmp->changed_gen;
+			rec.pid = tmp->pid;
+			rec.utime = tmp->reported.utime;
+			rec.stime = tmp->reported.stime;
+			rec.runtime_ns = tmp->reported.runtime;
+			rec.last_update = tmp->reported_update;
+		} while (read_seqcount_retry(&tmp->reported_seq, seq));
+
+		/* Skip what the reader has seen and what a pass running
+		   right now is changing */
+		if (changed_gen <= r->last_gen || changed_gen > r->cur_gen) {
+			continue;
+		}
+		if (skip) {
+			skip--;
+			continue;
+		}
+		if (nr == max) {
+			more = true;
+			break;
+		}
+		mp1_dev_buf[nr++] = rec;
 	}
+	rcu_read_unlock();
 
-	/* Allocate a new list entry */
-	tmp = kmalloc(sizeof(*tmp), GFP_KERNEL);
+	if (more) {
+		r->pos += nr;
+	} else {
+		r->last_gen = r->cur_gen;
+		r->pos = 0;
+	}
 
-	/* Store the pid */
-	sscanf(pid_str,"%u", &tmp->pid);
+	return nr;
+}
 
-	/* Initialize time to 0 */
-	tmp->cpu_time = 0;
+/* Func: mp1_dev_open
+ * Desc: Allocate the reader state. A new reader gets every registered
+ *       process on its first read
+ *
+ */
+static int mp1_dev_open(struct inode *inode, struct file *filp)
+{
+	struct mp1_dev_reader *r;
 
-	/* Initialize list structure in the entry */
-	INIT_LIST_HEAD(&tmp->list);
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (r == NULL) {
+		return -ENOMEM;
+	}
 
-	/* Enter critical region */
-	if (down_interruptible(&mp1_sem)) {
-		printk(KERN_INFO "mp1:Unable to enter critical region\n");
-		return 0;
+	filp->private_data = r;
+	return 0;
+}
+
+static int mp1_dev_release(struct inode *inode, struct file *filp)
+{
+	kfree(filp->private_data);
+	return 0;
+}
+
+/* Func: mp1_dev_read
+ * Desc: Return struct mp1_record entries for the processes whose cpu
+ *       times changed since the caller's last read. Blocks until an
+ *       update pass changes one, unless the file is O_NONBLOCK
+ *
+ */
+static ssize_t mp1_dev_read(struct file *filp, char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct mp1_dev_reader *r = filp->private_data;
+	unsigned int max, nr;
+	ssize_t ret;
+
+	/* Only whole records are returned */
+	if (count < sizeof(struct mp1_record)) {
+		return -EINVAL;
 	}
+	max = min_t(size_t, count / sizeof(struct mp1_record), snapshot_max);
 
-	/* For the first entry, start the timer */
-	if (list_empty(&mp1_proc_list.list)) {
-		printk(KERN_INFO "mp1:list is empty..starting timer\n");
-		/* Starting timer for 5 secs from now */
-		ret = mod_timer(&mp1_timer, jiffies + msecs_to_jiffies(5000));
-		/* Not able to start the timer? */
-		if (ret) {
-			printk(KERN_INFO "mp1:Error in mod_timer\n");
+	while (1) {
+		if (mutex_lock_interruptible(&mp1_dev_mutex)) {
+			return -ERESTARTSYS;
+		}
+
+		/* The changed processes may have been removed since, wait
+		   again then */
+		if (r->pos || mp1_dev_ready(r)) {
+			nr = mp1_dev_collect(r, max);
+			if (nr) {
+				break;
+			}
+		}
+		mutex_unlock(&mp1_dev_mutex);
+
+		if (filp->f_flags & O_NONBLOCK) {
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(mp1_dev_waitqueue,
+					     mp1_dev_ready(r))) {
+			return -ERESTARTSYS;
 		}
 	}
 
-	/* Add the entry to the head */
-	list_add_tail(&(tmp->list), &(mp1_proc_list.list));
+	if (copy_to_user(buf, mp1_dev_buf, nr * sizeof(struct mp1_record))) {
+		ret = -EFAULT;
+	} else {
+		ret = nr * sizeof(struct mp1_record);
+	}
 
-	/* Exit critical region */
-	up(&mp1_sem);
+	mutex_unlock(&mp1_dev_mutex);
+	return ret;
+}
 
-	return len;
+/* Func: mp1_dev_poll
+ * Desc: Readable when records are left over from the last read or an
+ *       update pass changed records since
+ *
+ */
+static unsigned int mp1_dev_poll(struct file *filp, poll_table *wait)
+{
+	struct mp1_dev_reader *r = filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &mp1_dev_waitqueue, wait);
+
+	if (ACCESS_ONCE(r->pos) || mp1_dev_ready(r)) {
+		mask |= POLLIN | POLLRDNORM;
+	}
+
+	return mask;
 }
 
+/* File operations for /dev/mp1 */
+static const struct file_operations mp1_dev_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp1_dev_open,
+	.read    = mp1_dev_read,
+	.poll    = mp1_dev_poll,
+	.mmap    = mp1_dev_mmap,
+	.release = mp1_dev_release,
+	.llseek  = no_llseek,
+};
+
+static struct miscdevice mp1_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name  = "mp1",
+	.fops  = &mp1_dev_fops,
+};
+
 /* Func: mp1_kernel_thread_fn
  * Desc: Kernel thread to update the linked list of
  *       registered processes
@@ -142,8 +2341,8 @@ int mp1_write_proc(struct file *filp, const char __user *buff,
  */
 int mp1_kernel_thread_fn(void *unused)
 {
-	MP1_PROC_ENTRY *tmp, *swap;
-	int ret;
+	u64 start, cost;
+	bool changed;
 
 	/* Declare a waitqueue */
 	DECLARE_WAITQUEUE(wait,current);
@@ -164,22 +2363,24 @@ int mp1_kernel_thread_fn(void *unused)
 			break;
 		}
 
-		printk(KERN_INFO "mp1:updating cpu time of processes\n");
+		/* Update the processes and measure how long it took */
+		start = ktime_to_ns(ktime_get());
+		changed = mp1_update_pass();
+		cost = ktime_to_ns(ktime_get()) - start;
 
 		/* Enter critical region */
-		if (down_interruptible(&mp1_sem)) {
-			printk(KERN_INFO "mp1: Cannot enter critical region\n");
-		}
-
-		/* Traverse the list and update the cpu time for each registered
-		   process */
-		list_for_each_entry_safe(tmp, swap, &mp1_proc_list.list, list) {
-			/* check for return value and update link list accordingly */
-			if (get_cpu_use(tmp->pid, &tmp->cpu_time) == -1) {
-				printk(KERN_INFO "mp1:deleting %u\n",tmp->pid);
-				list_del(&tmp->list);
-				kfree(tmp);
-			}
+		spin_lock(&mp1_lock);
+
+		mp1_stats.passes++;
+		mp1_stats.last_ns = cost;
+		mp1_stats.total_ns += cost;
+		if (cost > mp1_stats.max_ns) {
+			mp1_stats.max_ns = cost;
+		}
+
+		mp1_generation++;
+		if (changed) {
+			mp1_changed_generation = mp1_generation;
 		}
 
 		if (list_empty(&mp1_proc_list.list)) {
@@ -187,16 +2388,16 @@ int mp1_kernel_thread_fn(void *unused)
 			printk(KERN_INFO "mp1:All entries removed. Not starting timer\n");
 		} else {
 			/* Start the timer here */
-			ret = mod_timer(&mp1_timer, jiffies + msecs_to_jiffies(5000));
-
-			/* Not able to start the timer? */
-			if (ret) {
-				printk(KERN_INFO "mp1:Error in mod_timer\n");
-			}
+			mp1_start_timer(false);
 		}
 
 		/* Exit critical region */
-		up(&mp1_sem);
+		spin_unlock(&mp1_lock);
+
+		/* Wake /dev/mp1 readers once per pass with new samples */
+		if (changed) {
+			wake_up_interruptible(&mp1_dev_waitqueue);
+		}
 	}
 
 	/* exiting thread, set it to running state */
@@ -208,13 +2409,230 @@ int mp1_kernel_thread_fn(void *unused)
 	return 0;
 }
 
-/* Func: mp1_init_module
- * Desc: Module initialization code
+/* Func: mp1_sched_switch_probe
+ * Desc: sched_switch tracepoint probe. When a registered process is
+ *       switched in, note the time. When it is switched out, add the
+ *       time it ran since then to its runtime, so that status reads are
+ *       current without any polling. The update pass charges the
+ *       processes that stay on a CPU
  *
  */
-static int __init mp1_init_module(void)
+static void mp1_sched_switch_probe(void *ignore, struct task_struct *prev,
+				   struct task_struct *next)
 {
-	int ret = 0;
+	MP1_PROC_ENTRY *tmp;
+	struct mp1_cputime times;
+	u64 now;
+
+	/* Nothing registered, keep the context switch path cheap */
+	if (list_empty(&mp1_proc_list.list)) {
+		return;
+	}
+
+	/* The same clock as the update pass, which may charge the task
+	   from another CPU */
+	now = ktime_to_ns(ktime_get());
+
+	rcu_read_lock();
+	tmp = mp1_find_entry(prev->pid);
+	if (tmp && tmp->task == prev) {
+		/* User and system time only move at ticks anyway */
+		mp1_read_cputime(prev, false, &times);
+
+		/* Interrupts are off on the switch path */
+		spin_lock(&tmp->acct_lock);
+		mp1_charge_runtime(tmp, now);
+		tmp->switched_in = 0;
+		tmp->times.utime = times.utime;
+		tmp->times.stime = times.stime;
+		spin_unlock(&tmp->acct_lock);
+	}
+
+	tmp = mp1_find_entry(next->pid);
+	if (tmp && tmp->task == next) {
+		spin_lock(&tmp->acct_lock);
+		tmp->switched_in = now;
+		spin_unlock(&tmp->acct_lock);
+	}
+	rcu_read_unlock();
+}
+
+/* Func: mp1_sched_exit_probe
+ * Desc: sched_process_exit tracepoint probe. Log the final cpu times of
+ *       a registered process and drop its entry as soon as it exits,
+ *       before its pid can be reused
+ *
+ */
+static void mp1_sched_exit_probe(void *ignore, struct task_struct *p)
+{
+	MP1_PROC_ENTRY *tmp;
+	struct mp1_exit_record *rec;
+	bool found;
+
+	if (list_empty(&mp1_proc_list.list)) {
+		return;
+	}
+
+	/* Most exiting tasks are not registered, check without the lock */
+	rcu_read_lock();
+	tmp = mp1_find_entry(p->pid);
+	found = tmp && tmp->task == p;
+	rcu_read_unlock();
+
+	if (!found) {
+		return;
+	}
+
+	/* Enter critical region */
+	spin_lock(&mp1_lock);
+
+	tmp = mp1_find_entry(p->pid);
+	if (tmp && tmp->task == p) {
+		printk(KERN_INFO "mp1:deleting %u\n",tmp->pid);
+
+		/* Take the final sample and log it */
+		tmp->cpu_time = p->utime;
+		mp1_read_cputime(p, false, &tmp->times);
+
+		rec = &mp1_exit_log[mp1_exit_log_count % MP1_EXIT_LOG_SIZE];
+		rec->pid = tmp->pid;
+		rec->times = tmp->times;
+		mp1_exit_log_count++;
+
+		mp1_del_entry(tmp);
+	}
+
+	/* Exit critical region */
+	spin_unlock(&mp1_lock);
+}
+
+/* Func: mp1_exited_show
+ * Desc: Show the final cpu times of the registered processes that
+ *       exited, oldest first, as pid:utime:stime:runtime in nanoseconds
+ *
+ */
+static int mp1_exited_show(struct seq_file *m, void *v)
+{
+	struct mp1_exit_record *log;
+	unsigned int count, first, i;
+
+	/* Copy the log so that it is not printed under the spinlock */
+	log = kmalloc(sizeof(mp1_exit_log), GFP_KERNEL);
+	if (log == NULL) {
+		return -ENOMEM;
+	}
+
+	spin_lock(&mp1_lock);
+	memcpy(log, mp1_exit_log, sizeof(mp1_exit_log));
+	count = mp1_exit_log_count;
+	spin_unlock(&mp1_lock);
+
+	first = (count > MP1_EXIT_LOG_SIZE) ? count - MP1_EXIT_LOG_SIZE : 0;
+	for (i = first; i < count; i++) {
+		struct mp1_exit_record *rec = &log[i % MP1_EXIT_LOG_SIZE];
+
+		seq_printf(m, "%u:%llu:%llu:%llu\n", rec->pid,
+			   rec->times.utime, rec->times.stime,
+			   rec->times.runtime);
+	}
+
+	kfree(log);
+
+	return 0;
+}
+
+static int mp1_open_exited(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, mp1_exited_show, NULL);
+}
+
+/* File operations for /proc/mp1/exited */
+static const struct file_operations mp1_exited_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp1_open_exited,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* Func: mp1_register_sched_probes
+ * Desc: Hook the exit tracepoint, and the switch tracepoint used for
+ *       event driven accounting
+ *
+ */
+static int mp1_register_sched_probes(void)
+{
+	int ret;
+
+	ret = register_trace_sched_process_exit(mp1_sched_exit_probe, NULL);
+	if (ret || !sched_accounting) {
+		return ret;
+	}
+
+	ret = register_trace_sched_switch(mp1_sched_switch_probe, NULL);
+	if (ret) {
+		unregister_trace_sched_process_exit(mp1_sched_exit_probe, NULL);
+		tracepoint_synchronize_unregister();
+	}
+
+	return ret;
+}
+
+/* Func: mp1_unregister_sched_probes
+ * Desc: Unhook the scheduler tracepoints and wait for running probes
+ *
+ */
+static void mp1_unregister_sched_probes(void)
+{
+	if (sched_accounting) {
+		unregister_trace_sched_switch(mp1_sched_switch_probe, NULL);
+	}
+	unregister_trace_sched_process_exit(mp1_sched_exit_probe, NULL);
+	tracepoint_synchronize_unregister();
+}
+
+/* Files created under /proc/mp1 */
+static const struct mp1_proc_file {
+	const char *name;
+	umode_t mode;
+	const struct file_operations *fops;
+} mp1_proc_files[] = {
+	{ "status",     0666, &mp1_proc_fops },
+	{ "cputime",    0444, &mp1_cputime_fops },
+	{ "cputime_tg", 0444, &mp1_cputime_tg_fops },
+	{ "stats",      0644, &mp1_stats_fops },
+	{ "load",       0444, &mp1_load_fops },
+	{ "last_write", 0666, &mp1_last_write_fops },
+	{ "exited",     0444, &mp1_exited_fops },
+	{ "quota",      0444, &mp1_quota_fops },
+	{ "top",        0444, &mp1_top_fops },
+	{ "groups",     0666, &mp1_groups_fops },
+	{ "history",    0666, &mp1_history_fops },
+};
+
+/* Func: mp1_remove_proc_files
+ * Desc: Remove the first nr files under /proc/mp1 and the directory
+ *       itself
+ *
+ */
+static void mp1_remove_proc_files(int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		remove_proc_entry(mp1_proc_files[i].name, proc_dir);
+	}
+
+	remove_proc_entry("mp1", NULL);
+}
+
+/* Func: mp1_create_proc_files
+ * Desc: Create the /proc/mp1 directory and the files under it
+ *
+ */
+static int mp1_create_proc_files(void)
+{
+	int i;
 
 	/* Create a proc directory entry mp1 */
 	proc_dir = proc_mkdir("mp1", NULL);
@@ -222,47 +2640,176 @@ static int __init mp1_init_module(void)
 	/* Check if directory was created */
 	if (proc_dir == NULL) {
 		printk(KERN_INFO "mp1: Couldn't create proc dir\n");
-		ret = -ENOMEM;
-	} else {
-		/* Create an entry status under proc dir mp1 */
-		proc_entry = create_proc_entry( "status", 0666, proc_dir);
+		return -ENOMEM;
+	}
 
+	for (i = 0; i < ARRAY_SIZE(mp1_proc_files); i++) {
 		/*Check if entry was created */
-		if (proc_entry == NULL) {
-			printk(KERN_INFO "mp1: Couldn't create proc entry\n");
-			ret = -ENOMEM;
-		} else {
+		if (proc_create(mp1_proc_files[i].name,
+				mp1_proc_files[i].mode,
+				proc_dir,
+				mp1_proc_files[i].fops) == NULL) {
+			printk(KERN_INFO "mp1: Couldn't create proc entry %s\n",
+			       mp1_proc_files[i].name);
+			/* Only the ones created so far */
+			mp1_remove_proc_files(i);
+			return -ENOMEM;
+		}
+	}
 
-			/* proc_entry->owner = THIS_MODULE; */
-			proc_entry->read_proc = mp1_read_proc;
-			proc_entry->write_proc = mp1_write_proc;
+	return 0;
+}
 
-			printk(KERN_INFO "mp1:MP1 module loaded\n");
+/* Func: mp1_del_all_entries
+ * Desc: Delete every registered process and every group once nothing
+ *       can register or update them anymore, and wait for their RCU
+ *       frees
+ *
+ */
+static void mp1_del_all_entries(void)
+{
+	MP1_PROC_ENTRY *tmp,*swap;
 
-			/* Initialize a linked list for mp1 proc details */
-			INIT_LIST_HEAD(&mp1_proc_list.list);
+	/* Delete each list entry and free the allocated structure */
+	spin_lock(&mp1_lock);
+	list_for_each_entry_safe(tmp, swap, &mp1_proc_list.list, list) {
+		printk(KERN_INFO "mp1:freeing %u\n",tmp->pid);
+		mp1_del_entry(tmp);
+	}
 
-			/* Initialize semaphore */
-			sema_init(&mp1_sem,1);
+	/* Groups outlive their members */
+	while (!list_empty(&mp1_groups)) {
+		mp1_remove_group(list_first_entry(&mp1_groups,
+						  struct mp1_group, list));
+	}
+	spin_unlock(&mp1_lock);
 
-			/* Create a kernel thread */
-			mp1_kernel_thread = kthread_run(mp1_kernel_thread_fn,
-							NULL,
-							"mp1kt");
+	/* Wait for the pending RCU frees, groups included, before the
+	   module text goes away */
+	rcu_barrier();
+}
 
-			/* If thread creation failed for some reason, cleanup */
-			if (mp1_kernel_thread == NULL) {
-				printk(KERN_INFO "mp1:thread not created\n");
-				remove_proc_entry("status", proc_dir);
-				remove_proc_entry("mp1", NULL);
-				ret = -ENOMEM;
-			} else {
-				/* Setup the timer */
-				setup_timer(&mp1_timer, mp1_timer_callback, 0);
-			}
+/* Func: mp1_init_module
+ * Desc: Module initialization code
+ *
+ */
+static int __init mp1_init_module(void)
+{
+	int ret = 0;
+	int i;
+
+	/* Initialize a linked list for mp1 proc details */
+	INIT_LIST_HEAD(&mp1_proc_list.list);
+
+	/* Initialize the pid hash table */
+	for (i = 0; i < (1 << MP1_HASH_BITS); i++) {
+		INIT_LIST_HEAD(&mp1_hash[i]);
+	}
+
+	/* Two heaps for the top consumers, one built while the other is
+	   read */
+	top_k = clamp_val(top_k, 1, MP1_MAX_TOP_K);
+	mp1_top = kcalloc(top_k, sizeof(*mp1_top), GFP_KERNEL);
+	mp1_top_work = kcalloc(top_k, sizeof(*mp1_top_work), GFP_KERNEL);
+	if (mp1_top == NULL || mp1_top_work == NULL) {
+		ret = -ENOMEM;
+		goto free_top;
+	}
+
+	/* Cache for the registry entries. History rings are allocated
+	   at registration, bound their size first */
+	history_len = min_t(unsigned int, history_len, MP1_MAX_HISTORY);
+	mp1_entry_cache = kmem_cache_create("mp1_proc_entry",
+					    sizeof(MP1_PROC_ENTRY), 0,
+					    SLAB_HWCACHE_ALIGN,
+					    mp1_entry_ctor);
+	if (mp1_entry_cache == NULL) {
+		ret = -ENOMEM;
+		goto free_top;
+	}
+
+	/* Preallocate the reserve if asked for */
+	if (entry_reserve) {
+		mp1_entry_pool = mempool_create_slab_pool(entry_reserve,
+							  mp1_entry_cache);
+		if (mp1_entry_pool == NULL) {
+			printk(KERN_INFO "mp1:Couldn't preallocate %u entries\n",
+			       entry_reserve);
+			ret = -ENOMEM;
+			goto destroy_cache;
 		}
 	}
 
+	/* Allocate the binary snapshot */
+	snapshot_max = clamp_val(snapshot_max, 1, MP1_MAX_SNAPSHOT);
+	ret = mp1_alloc_snapshot();
+	if (ret) {
+		printk(KERN_INFO "mp1:Couldn't allocate snapshot\n");
+		goto destroy_pool;
+	}
+
+	/* Setup the timer */
+	hrtimer_init(&mp1_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	mp1_timer.function = mp1_timer_callback;
+
+	/* Create a kernel thread */
+	mp1_kernel_thread = kthread_run(mp1_kernel_thread_fn,
+					NULL,
+					"mp1kt");
+
+	/* If thread creation failed for some reason, cleanup */
+	if (IS_ERR(mp1_kernel_thread)) {
+		printk(KERN_INFO "mp1:thread not created\n");
+		ret = PTR_ERR(mp1_kernel_thread);
+		goto free_snapshot;
+	}
+
+	/* Exit notification and event driven accounting */
+	ret = mp1_register_sched_probes();
+	if (ret) {
+		printk(KERN_INFO "mp1:tracepoints not registered\n");
+		goto stop_thread;
+	}
+
+	/* Registration opens with /proc/mp1, once the timer, the thread
+	   and the exit probe it relies on are set up */
+	ret = mp1_create_proc_files();
+	if (ret) {
+		goto unregister_probes;
+	}
+
+	/* Expose the snapshot through /dev/mp1 */
+	ret = misc_register(&mp1_dev);
+	if (ret) {
+		printk(KERN_INFO "mp1:Couldn't register /dev/mp1\n");
+		goto remove_proc;
+	}
+
+	printk(KERN_INFO "mp1:MP1 module loaded\n");
+
+	return 0;
+
+remove_proc:
+	mp1_remove_proc_files(ARRAY_SIZE(mp1_proc_files));
+unregister_probes:
+	mp1_unregister_sched_probes();
+stop_thread:
+	kthread_stop(mp1_kernel_thread);
+	hrtimer_cancel(&mp1_timer);
+	/* Processes may have registered while /proc/mp1 was up */
+	mp1_del_all_entries();
+free_snapshot:
+	vfree(mp1_dev_buf);
+	vfree(mp1_snapshot);
+destroy_pool:
+	if (mp1_entry_pool) {
+		mempool_destroy(mp1_entry_pool);
+	}
+destroy_cache:
+	kmem_cache_destroy(mp1_entry_cache);
+free_top:
+	kfree(mp1_top);
+	kfree(mp1_top_work);
 	return ret;
 }
 
@@ -272,31 +2819,38 @@ static int __init mp1_init_module(void)
  */
 static void __exit mp1_exit_module(void)
 {
-	MP1_PROC_ENTRY *tmp,*swap;
-
-	/* Delete the timer */
-	del_timer_sync(&mp1_timer);
-
-	/* Remove the status entry first */
-	remove_proc_entry("status", proc_dir);
-
-	/* Remove the mp1 proc dir now */
-	remove_proc_entry("mp1", NULL);
+	/* Remove the device and the proc entries first */
+	misc_deregister(&mp1_dev);
+	mp1_remove_proc_files(ARRAY_SIZE(mp1_proc_files));
 
 	printk(KERN_INFO "mp1:MP1 module unloaded\n");
 
-	/* Delete each list entry and free the allocated structure */
-	list_for_each_entry_safe(tmp, swap, &mp1_proc_list.list, list) {
-		printk(KERN_INFO "mp1:freeing %u\n",tmp->pid);
-		list_del(&tmp->list);
-		kfree(tmp);
-	}
+	/* Unhook the probes */
+	mp1_unregister_sched_probes();
 
 	/* Before stopping the thread, put it into running state */
 	wake_up_interruptible(&mp1_waitqueue);
 
 	/* now stop the thread */
 	kthread_stop(mp1_kernel_thread);
+
+	/* Delete the timer. The thread can no longer re-arm it */
+	hrtimer_cancel(&mp1_timer);
+
+	mp1_del_all_entries();
+
+	/* Every entry is back in the reserve or the cache */
+	if (mp1_entry_pool) {
+		mempool_destroy(mp1_entry_pool);
+	}
+	kmem_cache_destroy(mp1_entry_cache);
+
+	/* No mapping or reader can outlive the device, free the snapshot */
+	vfree(mp1_dev_buf);
+	vfree(mp1_snapshot);
+
+	kfree(mp1_top);
+	kfree(mp1_top_work);
 }
 
 module_init(mp1_init_module);
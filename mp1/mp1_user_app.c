@@ -6,6 +6,12 @@
 #include<stdio.h>
 #include<string.h>
 #include<stdlib.h>
+#include<unistd.h>
+
+#include "libmp1.h"
+
+/* Connection to the module, kept open for the whole run */
+struct mp1_handle mp1;
 
 /*
  * Func: register_process
@@ -13,10 +19,10 @@
  *
  */
 void register_process(int pid) {
-        char command[100];
 	/* Write to /proc/mp1/status */
-        sprintf(command, "echo %d >/proc/mp1/status", pid);
-        system(command);
+	if (mp1_register(&mp1, pid) < 0) {
+		perror("register");
+	}
 }
 
 /*
@@ -26,11 +32,21 @@ void register_process(int pid) {
  */
 void read_proc()
 {
+	struct mp1_status st[64];
+	int i, n;
+
 	/* read from /proc/mp1/status */
-	char command[] = "cat /proc/mp1/status";
+	n = mp1_read_status(&mp1, st, 64);
+	if (n < 0) {
+		perror("read");
+		return;
+	}
+
 	printf("Printing return value of read from /proc/mp1/status\n");
 	printf("PID:CPU Time\n");
-	system(command);
+	for (i = 0; i < n && i < 64; i++) {
+		printf("%d:%lu\n", (int)st[i].pid, st[i].cpu_time);
+	}
 }
 
 /*
@@ -95,6 +111,12 @@ void main(int argc, char **argv)
 		n = atoi(argv[1]);
 	}
 
+	/* Open /proc/mp1/status once */
+	if (mp1_open(&mp1) < 0) {
+		perror(MP1_STATUS_FILE);
+		exit(1);
+	}
+
 	/* Get pid of the process */
 	pid=getpid(); 
 	printf("PID of this process is %d", pid); 
@@ -107,4 +129,6 @@ void main(int argc, char **argv)
 
 	/* Read the entry in /proc/mp1/status */
 	read_proc();
+
+	mp1_close(&mp1);
 }
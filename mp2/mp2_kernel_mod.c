@@ -4,10 +4,23 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <asm/uaccess.h>
 #include <linux/sched.h>
 #include <linux/kthread.h>
 #include <linux/list.h>
+#include <linux/hash.h>
+#include <linux/bitops.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+#include <linux/cpumask.h>
+#include <linux/wait.h>
 
 #include "mp2_given.h"
 
@@ -16,26 +29,107 @@
 #define MP2_TASK_READY    1
 #define MP2_TASK_SLEEPING 2
 
+/* Real time priorities: the dispatchers run above the task they dispatch
+   so that they can take the CPU back from it */
+#define MP2_TASK_RT_PRIO  (MAX_USER_RT_PRIO - 2)
+#define MP2_SCHED_RT_PRIO (MAX_USER_RT_PRIO - 1)
+
+/* Histogram buckets of the time distributions: bucket 0 counts times
+   under 1us, bucket i times in [2^(i-1), 2^i) us and the last one
+   everything longer */
+#define MP2_HIST_BUCKETS 24
+
+/* Distribution of a time in nanoseconds */
+struct mp2_dist {
+	u64 count;
+	u64 last;
+	u64 min;
+	u64 max;
+	u64 total;
+	u64 hist[MP2_HIST_BUCKETS];
+};
+
+/* Per task scheduling statistics, reset by writing /proc/mp2/stats */
+struct mp2_stats {
+	/* Jobs released and completed */
+	u64 released;
+	u64 completed;
+	/* Jobs completed after their deadline, or not completed at all by
+	   the next release */
+	u64 misses;
+	/* Times the task was scheduled out for a more urgent one */
+	u64 preemptions;
+	/* Jobs that exhausted their budget */
+	u64 overruns;
+	/* From release to completion */
+	struct mp2_dist response;
+	/* Delay between the intended release and the timer handler
+	   queueing the job */
+	struct mp2_dist jitter;
+};
+
 /* MP2 task struct */
 struct mp2_task_struct {
 	/* PID of the registered process */
 	unsigned int pid;
-	/* Pointer to the task_struct of the process */
+	/* Pointer to the task_struct of the process, referenced until the
+	   entry is freed */
 	struct task_struct *task;
+	/* Affinity of the process before it registered, restored when it
+	   leaves */
+	cpumask_var_t orig_mask;
 	/* Timer to wake up this process at the end of period */
-	struct timer_list wakeup_timer;
-	/* Computation time in milliseconds */
+	struct hrtimer wakeup_timer;
+	/* Timer for the execution budget of the current job, running while
+	   the task is dispatched */
+	struct hrtimer budget_timer;
+	/* Budget left to the current job in nanoseconds, the execution
+	   time of the task (se.sum_exec_runtime) it was last charged from
+	   and whether the budget is used up */
+	u64 budget_left;
+	u64 exec_start;
+	bool exhausted;
+	/* Whether the task was stopped with SIGSTOP for overrunning its
+	   budget, until it is dispatched again. Under the CPU's run queue
+	   lock */
+	bool stopped;
+	/* Computation time in microseconds */
 	unsigned int C;
-	/* Period of the process */
+	/* Period of the process in microseconds */
 	unsigned int P;
 	/* List head for maintaining list of all registered processes */
 	struct list_head task_list;
-	/* List head for run queue */
+	/* CPU the task is partitioned to, and its entry in the period
+	   sorted task list of that CPU */
+	struct mp2_cpu *cpu;
+	struct list_head cpu_list;
+	/* Chain in the pid hash table */
+	struct list_head hash_list;
+	/* List head for run queue, empty when not queued */
 	struct list_head mp2_rq_list;
-	/* Time of next period in jiffies */
-	u64 next_period;
+	/* Rate monotonic priority rank, 0 for the shortest period */
+	unsigned int prio;
+	/* Node in the EDF run queue, cleared when not queued */
+	struct rb_node edf_node;
+	/* Absolute CLOCK_MONOTONIC time of the next release, which is also
+	   the deadline of the released job. Advanced by whole periods on
+	   each release so that releases do not drift */
+	ktime_t next_period;
+	/* Worst case response time in microseconds from response time
+	   analysis under RMS, 0 under EDF */
+	u64 wcrt;
+	/* Whether a released job has not completed yet, and the task's
+	   statistics. Under the CPU's run queue lock */
+	bool job_active;
+	struct mp2_stats stats;
 	/* MP2 state of the task */
 	unsigned int state;
+	/* References from the task list and from a dispatcher changing the
+	   task's policy, the entry is freed with the last one */
+	atomic_t refs;
+	/* Set under the CPU's run queue lock on deregistration, after which
+	   the task is neither queued nor dispatched again */
+	bool removed;
 };
 
 /* Entries in procfs */
@@ -44,190 +138,1031 @@ static struct proc_dir_entry *proc_dir, *proc_entry;
 /* List for holding all the tasks registered with MP2 module */
 static struct list_head mp2_task_struct_list;
 
-/* Run queue list for the scheduler */
-static struct list_head mp2_rq;
+/* Hash table of registered tasks keyed by pid, for the yield and
+   deregister paths. Under mp2_sem */
+#define MP2_HASH_BITS 8
+static struct list_head mp2_hash[1 << MP2_HASH_BITS];
+
+/* Number of priority levels, and so of distinct periods. Also bounds
+   the number of registered tasks */
+#define MP2_NR_PRIO 1024
+
+/* Run queue: one FIFO per priority rank and a bitmap of the non empty
+   ones, so that insert, remove and picking the highest priority task
+   do not depend on the number of tasks */
+struct mp2_runqueue {
+	DECLARE_BITMAP(bitmap, MP2_NR_PRIO);
+	struct list_head queue[MP2_NR_PRIO];
+};
+
+/* Per CPU scheduler state. Tasks are partitioned: each one is pinned to
+   a CPU at registration and only ever runs there */
+struct mp2_cpu {
+	int cpu;
+	/* Lock for the run queues, taken from the timer handlers, and the
+	   IRQ state saved while it is held */
+	spinlock_t lock;
+	unsigned long flags;
+	/* Run queue for the scheduler */
+	struct mp2_runqueue rq;
+	/* Run queue for EDF, ordered by absolute deadline, and its first
+	   node */
+	struct rb_root edf_rq;
+	struct rb_node *edf_leftmost;
+	/* Tasks on this CPU sorted by period, their number and their
+	   total utilization in MP2_FSHIFT fixed point. Under mp2_sem */
+	struct list_head tasks;
+	unsigned int nr_tasks;
+	u64 util;
+	/* Currently running process. Under the run queue lock, the
+	   dispatcher never takes mp2_sem so that nothing running at a lower
+	   priority can hold it up */
+	struct mp2_task_struct *curr;
+	/* Wait queue for the dispatcher thread to wait on */
+	wait_queue_head_t waitqueue;
+	/* Dispatcher thread, bound to the CPU */
+	struct task_struct *kthread;
+};
+
+/* Scheduler state of the online CPUs at load time, NULL for the others */
+static struct mp2_cpu *mp2_cpus[NR_CPUS];
+
+/* Partitioning heuristic for admission */
+static bool worst_fit;
+module_param(worst_fit, bool, 0444);
+MODULE_PARM_DESC(worst_fit, "Place tasks on the least loaded CPU that fits instead of the first");
+
+/* What to do with a job that exhausts its budget */
+static bool overrun_suspend;
+module_param(overrun_suspend, bool, 0444);
+MODULE_PARM_DESC(overrun_suspend, "Stop a task that overruns its budget with SIGSTOP until its next release instead of demoting it to SCHED_NORMAL");
+
+/* Scheduling policy, chosen at load time */
+static bool edf;
+module_param(edf, bool, 0444);
+MODULE_PARM_DESC(edf, "Schedule earliest deadline first instead of rate monotonic");
+
+/* Admit task sets under RMS by exact response time analysis rather than
+   the Liu-Layland utilization bound */
+static bool rta;
+module_param(rta, bool, 0444);
+MODULE_PARM_DESC(rta, "Exact response time analysis admission for RMS");
+
+/* Shortest time before the budget timer looks at the execution time of
+   a task again. The execution time of a running task only advances at
+   ticks and context switches */
+#define MP2_BUDGET_RECHECK_NS	(100 * NSEC_PER_USEC)
 
-/* Currently running process */
-static struct mp2_task_struct *mp2_current;
+/* Fixed point for utilizations in admission control */
+#define MP2_FSHIFT	20
+#define MP2_FIXED_1	(1ULL << MP2_FSHIFT)
+/* ln 2, the Liu-Layland bound for any number of tasks */
+#define MP2_LL_BOUND	(693 * MP2_FIXED_1 / 1000)
 
-/* Wait queue for kernel thread to wait on */
-static DECLARE_WAIT_QUEUE_HEAD (mp2_waitqueue);
 
-/* Kernel Thread */
-static struct task_struct *mp2_sched_kthread;
+/* Measure the run queue at load time against the sorted list it
+   replaced */
+static bool rq_bench;
+module_param(rq_bench, bool, 0444);
+MODULE_PARM_DESC(rq_bench, "Benchmark run queue releases at load time");
 
 /* Semaphore for synchronization on the list */
 static struct semaphore mp2_sem;
 
-/* For saving the state */
-static unsigned long flags;
+/*
+ * Func: mp2_irq_disable
+ * Desc: Take the run queue lock of a CPU with IRQs disabled to achieve
+ *       synchrony between the timer handlers and the kernel thread
+ *
+ */
+void mp2_irq_disable(struct mp2_cpu *c)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&c->lock, flags);
+	c->flags = flags;
+}
+
+/*
+ * Func: mp2_irq_enable
+ * Desc: Release the run queue lock and enable IRQ again
+ *
+ */
+void mp2_irq_enable(struct mp2_cpu *c)
+{
+	spin_unlock_irqrestore(&c->lock, c->flags);
+}
 
 /*
- * Func: mp2_read_proc
- * Desc: Reading proc entry
+ * Func: mp2_seq_start
+ * Desc: Start a chunk of the status file at the task *pos. mp2_sem is
+ *       held until mp2_seq_stop
  *
  */
-int mp2_read_proc(char *page, char **start, off_t off,
-		  int count, int *eof, void *data)
+static void *mp2_seq_start(struct seq_file *m, loff_t *pos)
 {
-	int len = 0, i=1;
 	struct mp2_task_struct *tmp;
+	loff_t n = *pos;
 
 	/* Enter critical region */
-        if (down_interruptible(&mp2_sem)) {
-                printk(KERN_INFO "mp2:Unable to enter critical region\n");
-                return 0;
-        }
+	if (down_interruptible(&mp2_sem)) {
+		return ERR_PTR(-ERESTARTSYS);
+	}
 
-	/* Traverse the list and put values into page */
-        list_for_each_entry(tmp, &mp2_task_struct_list, task_list) {
-		len += sprintf(page+len, "Process # %d details:\n",i);
-		len += sprintf(page+len, "PID:%u\n",tmp->pid);
-		len += sprintf(page+len, "P:%u\n",tmp->P);
-		len += sprintf(page+len, "C:%u\n",tmp->C);
-		i++;
-        }
+	/* Skip over the tasks already sent in previous chunks */
+	list_for_each_entry(tmp, &mp2_task_struct_list, task_list) {
+		if (n-- == 0) {
+			m->private = (void *)(unsigned long)(*pos + 1);
+			return &tmp->task_list;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Func: mp2_seq_next
+ * Desc: Advance to the next registered task
+ *
+ */
+static void *mp2_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct list_head *next = ((struct list_head *)v)->next;
+
+	++*pos;
+	m->private = (void *)(unsigned long)(*pos + 1);
+
+	return (next == &mp2_task_struct_list) ? NULL : next;
+}
+
+/*
+ * Func: mp2_seq_stop
+ * Desc: End of a chunk. Leave the critical region entered in mp2_seq_start
+ *
+ */
+static void mp2_seq_stop(struct seq_file *m, void *v)
+{
+	if (!IS_ERR(v)) {
+		/* Exit critical region */
+		up(&mp2_sem);
+	}
+}
+
+/*
+ * Func: mp2_seq_show
+ * Desc: Show the details of one registered task
+ *
+ */
+static int mp2_seq_show(struct seq_file *m, void *v)
+{
+	struct mp2_task_struct *tmp =
+		list_entry(v, struct mp2_task_struct, task_list);
+
+	seq_printf(m, "Process # %lu details:\n", (unsigned long)m->private);
+	seq_printf(m, "PID:%u\n", tmp->pid);
+	seq_printf(m, "CPU:%d\n", tmp->cpu->cpu);
+	seq_printf(m, "P:%u\n", tmp->P);
+	seq_printf(m, "C:%u\n", tmp->C);
+	seq_printf(m, "WCRT:%llu\n", tmp->wcrt);
+	seq_printf(m, "Overruns:%llu\n", tmp->stats.overruns);
+	seq_printf(m, "Jitter(ns) last:%llu avg:%llu max:%llu\n",
+		   tmp->stats.jitter.last,
+		   tmp->stats.jitter.count ?
+		   div64_u64(tmp->stats.jitter.total,
+			     tmp->stats.jitter.count) : 0,
+		   tmp->stats.jitter.max);
+
+	return 0;
+}
+
+static const struct seq_operations mp2_seq_ops = {
+	.start = mp2_seq_start,
+	.next  = mp2_seq_next,
+	.stop  = mp2_seq_stop,
+	.show  = mp2_seq_show,
+};
+
+/*
+ * Func: mp2_open_proc
+ * Desc: Open the status file as a seq_file so that any number of
+ *       registered tasks can be streamed out in chunks
+ *
+ */
+static int mp2_open_proc(struct inode *inode, struct file *filp)
+{
+	return seq_open(filp, &mp2_seq_ops);
+}
+
+/*
+ * Func: mp2_dist_add
+ * Desc: Account a time in nanoseconds to a distribution. Caller must hold
+ *       the run queue lock of the task's CPU
+ *
+ */
+void mp2_dist_add(struct mp2_dist *d, s64 ns)
+{
+	int bucket;
+
+	if (ns < 0) {
+		ns = 0;
+	}
+
+	if (d->count == 0 || ns < d->min) {
+		d->min = ns;
+	}
+	if (ns > d->max) {
+		d->max = ns;
+	}
+	d->count++;
+	d->last = ns;
+	d->total += ns;
+
+	bucket = fls64(div_u64(ns, NSEC_PER_USEC));
+	if (bucket >= MP2_HIST_BUCKETS) {
+		bucket = MP2_HIST_BUCKETS - 1;
+	}
+	d->hist[bucket]++;
+}
+
+/*
+ * Func: mp2_show_dist
+ * Desc: Print a distribution as min/avg/max and the histogram
+ *
+ */
+static void mp2_show_dist(struct seq_file *m, const char *name,
+			  struct mp2_dist *d)
+{
+	int i;
+
+	seq_printf(m, "%s_ns min:%llu avg:%llu max:%llu\n", name, d->min,
+		   d->count ? div64_u64(d->total, d->count) : 0, d->max);
+	seq_printf(m, "%s_hist:", name);
+	for (i = 0; i < MP2_HIST_BUCKETS; i++) {
+		seq_printf(m, " %llu", d->hist[i]);
+	}
+	seq_printf(m, "\n");
+}
+
+/* Func: mp2_stats_show
+ * Desc: Show the statistics of every registered task
+ *
+ */
+static int mp2_stats_show(struct seq_file *m, void *v)
+{
+	struct mp2_task_struct *tmp;
+	struct mp2_stats stats;
+	int i;
+
+	/* Enter critical region */
+	if (down_interruptible(&mp2_sem)) {
+		return -ERESTARTSYS;
+	}
+
+	/* Lower bounds of the histogram buckets */
+	seq_printf(m, "hist_us: 0");
+	for (i = 1; i < MP2_HIST_BUCKETS; i++) {
+		seq_printf(m, " %llu", 1ULL << (i - 1));
+	}
+	seq_printf(m, "\n");
 
-        /* Exit critical region */
-        up(&mp2_sem);
+	list_for_each_entry(tmp, &mp2_task_struct_list, task_list) {
+		/* Take a consistent copy */
+		mp2_irq_disable(tmp->cpu);
+		stats = tmp->stats;
+		mp2_irq_enable(tmp->cpu);
+
+		seq_printf(m, "PID:%u\n", tmp->pid);
+		seq_printf(m, "released:%llu\n", stats.released);
+		seq_printf(m, "completed:%llu\n", stats.completed);
+		seq_printf(m, "deadline_misses:%llu\n", stats.misses);
+		seq_printf(m, "preemptions:%llu\n", stats.preemptions);
+		seq_printf(m, "overruns:%llu\n", stats.overruns);
+		mp2_show_dist(m, "response", &stats.response);
+		mp2_show_dist(m, "jitter", &stats.jitter);
+	}
+
+	/* Exit critical region */
+	up(&mp2_sem);
+
+	return 0;
+}
+
+static int mp2_open_stats(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, mp2_stats_show, NULL);
+}
+
+/* Func: mp2_write_stats
+ * Desc: Any write resets the statistics of every registered task
+ *
+ */
+static ssize_t mp2_write_stats(struct file *filp, const char __user *buff,
+			       size_t len, loff_t *off)
+{
+	struct mp2_task_struct *tmp;
+
+	/* Enter critical region */
+	if (down_interruptible(&mp2_sem)) {
+		return -ERESTARTSYS;
+	}
+
+	list_for_each_entry(tmp, &mp2_task_struct_list, task_list) {
+		mp2_irq_disable(tmp->cpu);
+		memset(&tmp->stats, 0, sizeof(tmp->stats));
+		mp2_irq_enable(tmp->cpu);
+	}
+
+	/* Exit critical region */
+	up(&mp2_sem);
+
+	return len;
+}
+
+/* File operations for /proc/mp2/stats */
+static const struct file_operations mp2_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp2_open_stats,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+	.write   = mp2_write_stats,
+};
+
+/*
+ * Func: mp2_rq_init
+ * Desc: Initialize an empty run queue
+ *
+ */
+void mp2_rq_init(struct mp2_runqueue *rq)
+{
+	int i;
+
+	bitmap_zero(rq->bitmap, MP2_NR_PRIO);
+	for (i = 0; i < MP2_NR_PRIO; i++) {
+		INIT_LIST_HEAD(&rq->queue[i]);
+	}
+}
+
+/*
+ * Func: mp2_rq_enqueue
+ * Desc: Queue a task behind the tasks of the same priority
+ *
+ */
+void mp2_rq_enqueue(struct mp2_runqueue *rq, struct mp2_task_struct *tmp)
+{
+	list_add_tail(&tmp->mp2_rq_list, &rq->queue[tmp->prio]);
+	__set_bit(tmp->prio, rq->bitmap);
+}
+
+/*
+ * Func: mp2_rq_dequeue
+ * Desc: Remove a task from the run queue if it is queued
+ *
+ */
+void mp2_rq_dequeue(struct mp2_runqueue *rq, struct mp2_task_struct *tmp)
+{
+	if (list_empty(&tmp->mp2_rq_list)) {
+		return;
+	}
+
+	list_del_init(&tmp->mp2_rq_list);
+	if (list_empty(&rq->queue[tmp->prio])) {
+		__clear_bit(tmp->prio, rq->bitmap);
+	}
+}
+
+/*
+ * Func: mp2_rq_pick
+ * Desc: Return the highest priority queued task, or NULL
+ *
+ */
+struct mp2_task_struct *mp2_rq_pick(struct mp2_runqueue *rq)
+{
+	unsigned long prio = find_first_bit(rq->bitmap, MP2_NR_PRIO);
+
+	if (prio >= MP2_NR_PRIO) {
+		return NULL;
+	}
+
+	return list_first_entry(&rq->queue[prio], struct mp2_task_struct,
+				mp2_rq_list);
+}
+
+/*
+ * Func: mp2_edf_enqueue
+ * Desc: Insert a task in the EDF run queue by deadline, after the tasks
+ *       with the same deadline
+ *
+ */
+void mp2_edf_enqueue(struct mp2_cpu *c, struct mp2_task_struct *tmp)
+{
+	struct rb_node **link = &c->edf_rq.rb_node, *parent = NULL;
+	struct mp2_task_struct *entry;
+	s64 deadline = ktime_to_ns(tmp->next_period);
+	bool leftmost = true;
+
+	while (*link) {
+		parent = *link;
+		entry = rb_entry(parent, struct mp2_task_struct, edf_node);
+		if (deadline < ktime_to_ns(entry->next_period)) {
+			link = &parent->rb_left;
+		} else {
+			link = &parent->rb_right;
+			leftmost = false;
+		}
+	}
+
+	if (leftmost) {
+		c->edf_leftmost = &tmp->edf_node;
+	}
+
+	rb_link_node(&tmp->edf_node, parent, link);
+	rb_insert_color(&tmp->edf_node, &c->edf_rq);
+}
+
+/*
+ * Func: mp2_edf_dequeue
+ * Desc: Remove a task from the EDF run queue if it is queued
+ *
+ */
+void mp2_edf_dequeue(struct mp2_cpu *c, struct mp2_task_struct *tmp)
+{
+	if (RB_EMPTY_NODE(&tmp->edf_node)) {
+		return;
+	}
+
+	if (c->edf_leftmost == &tmp->edf_node) {
+		c->edf_leftmost = rb_next(&tmp->edf_node);
+	}
+
+	rb_erase(&tmp->edf_node, &c->edf_rq);
+	RB_CLEAR_NODE(&tmp->edf_node);
+}
+
+/*
+ * Func: mp2_add_task_to_rq
+ * Desc: Add the mp2 task to the run queue of its CPU. moved to READY state
+ *       from SLEEPING. Caller must hold the CPU's run queue lock
+ *
+ */
+void mp2_add_task_to_rq(struct mp2_task_struct *tmp)
+{
+	/* Task state updated to ready */
+	tmp->state = MP2_TASK_READY;
+
+	/* Already queued if it was preempted or released early */
+	if (edf) {
+		if (RB_EMPTY_NODE(&tmp->edf_node)) {
+			mp2_edf_enqueue(tmp->cpu, tmp);
+		}
+	} else if (list_empty(&tmp->mp2_rq_list)) {
+		mp2_rq_enqueue(&tmp->cpu->rq, tmp);
+	}
+}
+
+/*
+ * Func: mp2_remove_task_from_rq
+ * Desc: Remove task from the run queue of its CPU. Caller must hold the
+ *       CPU's run queue lock
+ *
+ */
+void mp2_remove_task_from_rq(struct mp2_task_struct *tmp)
+{
+	if (edf) {
+		mp2_edf_dequeue(tmp->cpu, tmp);
+	} else {
+		mp2_rq_dequeue(&tmp->cpu->rq, tmp);
+	}
+}
+
+/*
+ * Func: mp2_pick_task
+ * Desc: Return the task to run next on a CPU under the current policy, or
+ *       NULL. Caller must hold the CPU's run queue lock
+ *
+ */
+struct mp2_task_struct *mp2_pick_task(struct mp2_cpu *c)
+{
+	if (edf) {
+		if (c->edf_leftmost == NULL) {
+			return NULL;
+		}
+		return rb_entry(c->edf_leftmost, struct mp2_task_struct,
+				edf_node);
+	}
+
+	return mp2_rq_pick(&c->rq);
+}
+
+/*
+ * Func: mp2_preempts
+ * Desc: Check whether a task should preempt the running one: shorter
+ *       period rank under RMS, earlier deadline under EDF
+ *
+ */
+bool mp2_preempts(struct mp2_task_struct *tmp, struct mp2_task_struct *curr)
+{
+	if (edf) {
+		return ktime_to_ns(tmp->next_period) <
+		       ktime_to_ns(curr->next_period);
+	}
+
+	return tmp->prio < curr->prio;
+}
+
+/*
+ * Func: mp2_update_prio
+ * Desc: Give every task of a CPU its rate monotonic rank from the period
+ *       sorted task list, requeueing the queued ones. Only done on
+ *       registration. Caller must hold mp2_sem
+ *
+ */
+void mp2_update_prio(struct mp2_cpu *c)
+{
+	struct mp2_task_struct *tmp;
+	unsigned int prio = 0, last_P = 0;
+	bool queued;
+
+	mp2_irq_disable(c);
+	list_for_each_entry(tmp, &c->tasks, cpu_list) {
+		/* Tasks with the same period share a rank */
+		if (last_P && tmp->P != last_P) {
+			prio++;
+		}
+		last_P = tmp->P;
+
+		if (tmp->prio == prio) {
+			continue;
+		}
+
+		queued = !list_empty(&tmp->mp2_rq_list);
+		mp2_rq_dequeue(&c->rq, tmp);
+		tmp->prio = prio;
+		if (queued) {
+			mp2_rq_enqueue(&c->rq, tmp);
+		}
+	}
+	mp2_irq_enable(c);
+}
+
+/*
+ * Func: mp2_hash_head
+ * Desc: Hash chain for a pid
+ *
+ */
+static struct list_head *mp2_hash_head(unsigned int pid)
+{
+	return &mp2_hash[hash_32(pid, MP2_HASH_BITS)];
+}
+
+/*
+ * Func: find_mp2_task_by_pid
+ * Desc: Find a particular task using its pid. Caller must hold mp2_sem
+ *
+ */
+struct mp2_task_struct *find_mp2_task_by_pid(unsigned int pid)
+{
+	struct mp2_task_struct *tmp;
+
+	list_for_each_entry(tmp, mp2_hash_head(pid), hash_list) {
+		if (tmp->pid == pid) {
+			return tmp;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Func: wakeup_timer_handler
+ * Desc: Wakeup timer handler. The timer is embedded in its task, which is
+ *       not freed before the timer is cancelled
+ *
+ */
+enum hrtimer_restart wakeup_timer_handler(struct hrtimer *timer)
+{
+	struct mp2_task_struct *tmp = container_of(timer,
+						   struct mp2_task_struct,
+						   wakeup_timer);
+	struct mp2_cpu *c = tmp->cpu;
+	s64 jitter;
+
+	/* How late the release is */
+	jitter = ktime_to_ns(ktime_sub(ktime_get(),
+				       hrtimer_get_expires(timer)));
+
+	/* Add the task to runqueue, updating its state to ready. Its
+	   deadline is the next release */
+	mp2_irq_disable(c);
+	/* Deregistered while the timer was running */
+	if (tmp->removed) {
+		mp2_irq_enable(c);
+		return HRTIMER_NORESTART;
+	}
+	/* A job still active never yielded and is abandoned for the new
+	   one, past its deadline */
+	if (tmp->job_active) {
+		tmp->stats.misses++;
+	}
+	tmp->next_period = ktime_add_us(tmp->next_period, tmp->P);
+	tmp->budget_left = (u64)tmp->C * NSEC_PER_USEC;
+	tmp->job_active = true;
+	tmp->stats.released++;
+	mp2_dist_add(&tmp->stats.jitter, jitter);
+	mp2_add_task_to_rq(tmp);
+	mp2_irq_enable(c);
+
+	/* Wake up the scheduler thread of its CPU */
+	wake_up_interruptible(&c->waitqueue);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Func: budget_timer_handler
+ * Desc: The dispatched job may have used up its budget. The timer runs on
+ *       wall clock time, so it is armed again for what is left if the job
+ *       blocked or was preempted meanwhile. Otherwise the dispatcher
+ *       thread of its CPU deals with it, scheduling policies can't be
+ *       changed from here
+ *
+ */
+enum hrtimer_restart budget_timer_handler(struct hrtimer *timer)
+{
+	struct mp2_task_struct *tmp = container_of(timer,
+						   struct mp2_task_struct,
+						   budget_timer);
+	struct mp2_cpu *c = tmp->cpu;
+	u64 now, used;
+
+	mp2_irq_disable(c);
+	now = tmp->task->se.sum_exec_runtime;
+	used = now - tmp->exec_start;
+	if (used < tmp->budget_left) {
+		/* Charge what it did use and look again later */
+		tmp->budget_left -= used;
+		tmp->exec_start = now;
+		hrtimer_forward_now(timer,
+				    ns_to_ktime(max_t(u64, tmp->budget_left,
+						      MP2_BUDGET_RECHECK_NS)));
+		mp2_irq_enable(c);
+		return HRTIMER_RESTART;
+	}
+	tmp->budget_left = 0;
+	tmp->exhausted = true;
+	mp2_irq_enable(c);
+
+	wake_up_interruptible(&c->waitqueue);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Func: mp2_budget_start
+ * Desc: Start charging a dispatched job against its budget, by its
+ *       execution time from now on
+ *
+ */
+void mp2_budget_start(struct mp2_task_struct *tmp)
+{
+	tmp->exec_start = tmp->task->se.sum_exec_runtime;
+	hrtimer_start(&tmp->budget_timer, ns_to_ktime(tmp->budget_left),
+		      HRTIMER_MODE_REL);
+}
+
+/*
+ * Func: mp2_budget_stop
+ * Desc: Stop charging a job that is preempted or done, keeping what is
+ *       left of its budget
+ *
+ */
+void mp2_budget_stop(struct mp2_task_struct *tmp)
+{
+	u64 used;
+
+	/* Only the handler sets exhausted, after which nothing is left */
+	if (hrtimer_cancel(&tmp->budget_timer) == 0) {
+		return;
+	}
+
+	/* It is switched out, so its execution time is up to date */
+	used = tmp->task->se.sum_exec_runtime - tmp->exec_start;
+	if (used >= tmp->budget_left) {
+		tmp->budget_left = 0;
+	} else {
+		tmp->budget_left -= used;
+	}
+}
+
+/*
+ * Func: mp2_utilization
+ * Desc: C/P as MP2_FSHIFT fixed point, rounded up so that admission
+ *       errs on the safe side
+ *
+ */
+static u64 mp2_utilization(struct mp2_task_struct *tmp)
+{
+	return div_u64(((u64)tmp->C << MP2_FSHIFT) + tmp->P - 1, tmp->P);
+}
+
+/*
+ * Func: mp2_response_time
+ * Desc: Worst case response time of a task under RMS in microseconds,
+ *       by iterating R = C + sum(ceil(R / Pj) * Cj) over the tasks with
+ *       the same or a shorter period on its CPU. Stops early past the
+ *       period. Caller must hold mp2_sem
+ *
+ */
+static u64 mp2_response_time(struct mp2_task_struct *tmp)
+{
+	struct mp2_task_struct *hp;
+	u64 R = 0, next = tmp->C;
+
+	/* Start from all the work that can be pending at once */
+	list_for_each_entry(hp, &tmp->cpu->tasks, cpu_list) {
+		if (hp->P > tmp->P) {
+			break;
+		}
+		if (hp != tmp) {
+			next += hp->C;
+		}
+	}
+
+	/* R only grows, so this ends at a fixed point or past P */
+	while (next != R && next <= tmp->P) {
+		R = next;
+		next = tmp->C;
+		list_for_each_entry(hp, &tmp->cpu->tasks, cpu_list) {
+			if (hp->P > tmp->P) {
+				break;
+			}
+			if (hp != tmp) {
+				next += div_u64(R + hp->P - 1, hp->P) * hp->C;
+			}
+		}
+	}
+
+	return next;
+}
+
+/*
+ * Func: mp2_rta_schedulable
+ * Desc: Exact response time analysis of the tasks of a CPU under RMS.
+ *       With store set, saves each worst case response time for the
+ *       status file. Caller must hold mp2_sem
+ *
+ */
+static bool mp2_rta_schedulable(struct mp2_cpu *c, bool store)
+{
+	struct mp2_task_struct *tmp;
+	u64 R;
+
+	list_for_each_entry(tmp, &c->tasks, cpu_list) {
+		R = mp2_response_time(tmp);
+		if (store) {
+			tmp->wcrt = R;
+		} else if (R > tmp->P) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Func: mp2_update_wcrt
+ * Desc: Refresh the reported worst case response times after the task
+ *       set of a CPU changed. Only meaningful under RMS. Caller must hold
+ *       mp2_sem
+ *
+ */
+void mp2_update_wcrt(struct mp2_cpu *c)
+{
+	if (!edf) {
+		mp2_rta_schedulable(c, true);
+	}
+}
+
+/*
+ * Func: mp2_admission_control
+ * Desc: Admission control check of a CPU for a new process, which is
+ *       already in the task list of the CPU. Caller must hold mp2_sem
+ *
+ */
+bool mp2_admission_control(struct mp2_cpu *c, struct mp2_task_struct *new_task)
+{
+	struct mp2_task_struct *tmp;
+	u64 new_total_utilization = 0, hyperbolic = MP2_FIXED_1;
+
+	/* Add C/P values for all processes, including the new one */
+	list_for_each_entry(tmp, &c->tasks, cpu_list) {
+		new_total_utilization += mp2_utilization(tmp);
+
+		/* Product of (Ui + 1) for the hyperbolic bound, which
+		   stays below 2 when it passes */
+		if (hyperbolic <= 2 * MP2_FIXED_1) {
+			hyperbolic = (hyperbolic *
+				      (mp2_utilization(tmp) + MP2_FIXED_1)) >>
+				     MP2_FSHIFT;
+		}
+	}
+
+	/* Full utilization is exact for EDF */
+	if (edf) {
+		return new_total_utilization <= MP2_FIXED_1;
+	}
+
+	/* Liu-Layland bound unless asked for the exact test */
+	if (!rta) {
+		return new_total_utilization <= MP2_LL_BOUND;
+	}
+
+	/* No task set above full utilization is schedulable */
+	if (new_total_utilization > MP2_FIXED_1) {
+		return false;
+	}
+
+	/* The hyperbolic bound is sufficient and cheap */
+	if (hyperbolic <= 2 * MP2_FIXED_1) {
+		return true;
+	}
+
+	/* Otherwise the exact test decides */
+	return mp2_rta_schedulable(c, false);
+}
+
+/*
+ * Func: mp2_try_cpu
+ * Desc: Put a new task in the period sorted task list of a CPU if it
+ *       passes admission control there. Caller must hold mp2_sem
+ *
+ */
+static bool mp2_try_cpu(struct mp2_cpu *c, struct mp2_task_struct *new_task)
+{
+	struct mp2_task_struct *pos;
+
+	/* One priority level per task at most */
+	if (c->nr_tasks == MP2_NR_PRIO) {
+		return false;
+	}
+
+	/* Add entry to the list, kept sorted by period */
+	list_for_each_entry(pos, &c->tasks, cpu_list) {
+		if (pos->P > new_task->P) {
+			break;
+		}
+	}
+	list_add_tail(&new_task->cpu_list, &pos->cpu_list);
+	new_task->cpu = c;
+
+	if (mp2_admission_control(c, new_task)) {
+		c->nr_tasks++;
+		c->util += mp2_utilization(new_task);
+		return true;
+	}
+
+	list_del(&new_task->cpu_list);
+	new_task->cpu = NULL;
+	return false;
+}
+
+/*
+ * Func: mp2_assign_cpu
+ * Desc: Partition a new task: first fit tries the CPUs in order, worst
+ *       fit from the least to the most loaded. Returns false if no CPU
+ *       admits it. Caller must hold mp2_sem
+ *
+ */
+static bool mp2_assign_cpu(struct mp2_task_struct *new_task)
+{
+	cpumask_var_t tried;
+	struct mp2_cpu *c, *best;
+	bool ret = false;
+	int cpu;
+
+	if (!worst_fit) {
+		for_each_online_cpu(cpu) {
+			c = mp2_cpus[cpu];
+			if (c && mp2_try_cpu(c, new_task)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	if (!zalloc_cpumask_var(&tried, GFP_KERNEL)) {
+		return false;
+	}
+
+	while (1) {
+		/* Least loaded CPU not tried yet */
+		best = NULL;
+		for_each_online_cpu(cpu) {
+			c = mp2_cpus[cpu];
+			if (c && !cpumask_test_cpu(cpu, tried) &&
+			    (best == NULL || c->util < best->util)) {
+				best = c;
+			}
+		}
+
+		if (best == NULL) {
+			break;
+		}
+		if (mp2_try_cpu(best, new_task)) {
+			ret = true;
+			break;
+		}
+		cpumask_set_cpu(best->cpu, tried);
+	}
 
-	return len;
+	free_cpumask_var(tried);
+	return ret;
 }
 
 /*
- * Func: mp2_add_task_to_rq
- * Desc: Add the mp2 task to run queue. moved to READY state from SLEEPING
+ * Func: mp2_set_sched_priority
+ * Desc: Set schedule priority of processes as per given params
  *
  */
-void mp2_add_task_to_rq(struct mp2_task_struct *tmp)
+int mp2_set_sched_priority(struct mp2_task_struct *tmp,
+			   int policy,
+			   int priority)
 {
-	struct list_head *prev, *curr;
-	struct mp2_task_struct *curr_task;
-
-	/* Task state updated to ready */
-	tmp->state = MP2_TASK_READY;
-
-	/* Get the run queue head */
-	prev = &mp2_rq;
-	curr = prev->next;
-
-	/* Find the right position to insert the new task
-	   according to its priority
-	*/
-	list_for_each(curr, &mp2_rq) {
-		curr_task = list_entry(curr, typeof(*tmp), mp2_rq_list);
+	struct sched_param sparam;
+	int ret;
 
-		if (curr_task->P > tmp->P) {
-			break;
-		}
-		prev = curr;
+	/* Schedule priority */
+	sparam.sched_priority = priority;
+	/* Set the policy and priority */
+	ret = sched_setscheduler(tmp->task, policy, &sparam);
+	if (ret) {
+		printk(KERN_WARNING "mp2: Couldn't set policy %d of PID:%u: %d\n",
+		       policy, tmp->pid, ret);
 	}
 
-	/* Add it to run queue list */
-	__list_add(&(tmp->mp2_rq_list),prev,curr);
+	return ret;
 }
 
 /*
- * Func: mp2_remove_task_from_rq
- * Desc: Remove task from runqueue
+ * Func: mp2_free_task
+ * Desc: Free an mp2 task struct
  *
  */
-void mp2_remove_task_from_rq(struct mp2_task_struct *tmp)
+static void mp2_free_task(struct mp2_task_struct *tmp)
 {
-	list_del(&(tmp->mp2_rq_list));
+	if (tmp->task) {
+		put_task_struct(tmp->task);
+	}
+	free_cpumask_var(tmp->orig_mask);
+	kfree(tmp);
 }
 
 /*
- * Func: find_mp2_task_by_pid
- * Desc: Find a particular task using its pid
+ * Func: mp2_get_task
+ * Desc: Take a reference on an mp2 task struct
  *
  */
-struct mp2_task_struct *find_mp2_task_by_pid(unsigned int pid)
+static void mp2_get_task(struct mp2_task_struct *tmp)
 {
-	struct mp2_task_struct *tmp;
-
-	/* Enter critical region */
-        if (down_interruptible(&mp2_sem)) {
-                printk(KERN_INFO "mp2:Unable to enter critical region\n");
-                return 0;
-        }
-
-	/* Scan through the task list */
-	list_for_each_entry(tmp, &mp2_task_struct_list, task_list) {
-		if (tmp->pid == pid) {
-			break;
-		}
-	}
-
-	/* Check if task is not present. Return NULL in this case */
-	if (&tmp->task_list == &mp2_task_struct_list) {
-		printk(KERN_INFO "mp2: Task not found on list\n");
-		tmp = NULL;
-	}
-
-	/* Exit critical region */
-	up(&mp2_sem);
-
-	/* return the mp2 task struct */
-	return tmp;
+	atomic_inc(&tmp->refs);
 }
 
 /*
- * Func: wakeup_timer_handler
- * Desc: Wakeup timer handler
+ * Func: mp2_put_task
+ * Desc: Drop a reference on an mp2 task struct, freeing it with the last
  *
  */
-void wakeup_timer_handler(unsigned long pid)
+static void mp2_put_task(struct mp2_task_struct *tmp)
 {
-	struct mp2_task_struct *tmp = find_mp2_task_by_pid(pid);
-
-	/* tmp should not be NULL.. sanity check*/
-	if (tmp == NULL) {
-		printk(KERN_WARNING "mp2: task not found..strange!\n");
-		return;
+	if (atomic_dec_and_test(&tmp->refs)) {
+		mp2_free_task(tmp);
 	}
-
-	/* Update the task state to ready */
-	tmp->state = MP2_TASK_READY;
-
-	/* Add the task to runqueue */
-	mp2_add_task_to_rq(tmp);
-
-	/* Wake up kernel scheduler thread */
-	wake_up_interruptible(&mp2_waitqueue);
 }
 
 /*
- * Func: mp2_admission_control
- * Desc: Admission control check before registering a new process
+ * Func: mp2_release_task
+ * Desc: Give a leaving process back its normal policy and the affinity
+ *       it had before it registered. Nothing to do if it already exited
  *
  */
-bool mp2_admission_control(unsigned int C, unsigned int P)
+static void mp2_release_task(struct mp2_task_struct *tmp)
 {
-	struct mp2_task_struct *tmp;
-	long new_total_utilization = (C*1000)/P;
-
-	/* Enter critical region */
-        if (down_interruptible(&mp2_sem)) {
-                printk(KERN_INFO "mp2:Unable to enter critical region\n");
-                return false;
-        }
+	if (!pid_alive(tmp->task)) {
+		return;
+	}
 
-	/* Add C/P values for all exisiting processes */
-	list_for_each_entry(tmp, &mp2_task_struct_list, task_list) {
-		new_total_utilization += ((tmp->C)*1000)/(tmp->P);
+	/* Continue it if it was stopped for an overrun */
+	if (tmp->stopped) {
+		send_sig(SIGCONT, tmp->task, 1);
+		tmp->stopped = false;
 	}
 
-	/* Exit critical region */
-	up(&mp2_sem);
+	mp2_set_sched_priority(tmp, SCHED_NORMAL, 0);
 
-	/* If total utilization exceeds the limit, reject */
-	if (new_total_utilization>693) {
-		return false;
+	if (set_cpus_allowed_ptr(tmp->task, tmp->orig_mask)) {
+		printk(KERN_WARNING "mp2: Couldn't restore the affinity of PID:%u\n",
+		       tmp->pid);
 	}
-
-	/* else admit */
-	return true;
 }
 
 /*
@@ -239,9 +1174,23 @@ void mp2_register_process(char *user_data)
 {
 	char *tmp;
 	struct mp2_task_struct *new_task;
+	struct mp2_cpu *c;
 
 	/* Create a new mp2_task_struct entry */
-	new_task = kmalloc(sizeof(*new_task), GFP_KERNEL);
+	new_task = kzalloc(sizeof(*new_task), GFP_KERNEL);
+	if (new_task == NULL) {
+		printk(KERN_WARNING "mp2: Out of memory for registration\n");
+		return;
+	}
+	if (!alloc_cpumask_var(&new_task->orig_mask, GFP_KERNEL)) {
+		printk(KERN_WARNING "mp2: Out of memory for registration\n");
+		mp2_free_task(new_task);
+		return;
+	}
+	INIT_LIST_HEAD(&new_task->mp2_rq_list);
+	RB_CLEAR_NODE(&new_task->edf_node);
+	/* The reference of the task list */
+	atomic_set(&new_task->refs, 1);
 
 	/* Advance to PID in the string */
 	user_data += 3;
@@ -267,88 +1216,104 @@ void mp2_register_process(char *user_data)
 	*tmp = '\0';
 	sscanf(user_data, "%u", &new_task->C);
 
-	/* Check for admission control */
-	if (mp2_admission_control(new_task->C, new_task->P)==false) {
-		printk(KERN_WARNING "mp2: Registration for PID:%u failed during Admission Control",
-		new_task->pid);
-		kfree(new_task);
+	/* A job has to fit in its period */
+	if (new_task->P == 0 || new_task->C == 0 ||
+	    new_task->C > new_task->P) {
+		printk(KERN_WARNING "mp2: Invalid P:%u C:%u for PID:%u\n",
+		       new_task->P, new_task->C, new_task->pid);
+		mp2_free_task(new_task);
 		return;
 	}
 
-	printk(KERN_INFO "mp2: Registration for PID:%u with P:%u and C:%u\n",
-	       new_task->pid,
-	       new_task->P,
-	       new_task->C);
-
-	/* Find the task struct */
+	/* Find the task struct and pin it for the lifetime of the entry, a
+	   process may exit without deregistering */
+	rcu_read_lock();
 	new_task->task = find_task_by_pid(new_task->pid);
+	if (new_task->task) {
+		get_task_struct(new_task->task);
+	}
+	rcu_read_unlock();
 
 	if (new_task->task == NULL) {
 		printk(KERN_WARNING "mp2: Task not found\n");
-		kfree(new_task);
+		mp2_free_task(new_task);
 		return;
 	}
 
 	/* Calculate the next release time for this process */
-	new_task->next_period = jiffies + msecs_to_jiffies(new_task->P);
+	new_task->next_period = ktime_add_us(ktime_get(), new_task->P);
+
+	/* Setup the timer for this task, on absolute release times */
+	hrtimer_init(&new_task->wakeup_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_ABS);
+	new_task->wakeup_timer.function = wakeup_timer_handler;
+
+	/* Setup the budget timer, the first job gets a full budget */
+	hrtimer_init(&new_task->budget_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	new_task->budget_timer.function = budget_timer_handler;
+	new_task->budget_left = (u64)new_task->C * NSEC_PER_USEC;
+
+	/* Mark mp2 task state as sleeping */
+	new_task->state = MP2_TASK_SLEEPING;
 
 	/* Enter critical region */
         if (down_interruptible(&mp2_sem)) {
                 printk(KERN_INFO "mp2:Unable to enter critical region\n");
+		mp2_free_task(new_task);
                 return;
         }
 
-	/* Add entry to the list */
-	list_add_tail(&(new_task->task_list), &mp2_task_struct_list);
-
-	/* Exit critical region */
-	up(&mp2_sem);
+	/* A pid registers once */
+	if (find_mp2_task_by_pid(new_task->pid)) {
+		up(&mp2_sem);
+		printk(KERN_WARNING "mp2: PID:%u already registered\n",
+		       new_task->pid);
+		mp2_free_task(new_task);
+		return;
+	}
 
-	/* Setup the timer for this task */
-	setup_timer(&new_task->wakeup_timer, wakeup_timer_handler, new_task->pid);
+	/* Check for admission control on each candidate CPU, under the
+	   semaphore so that concurrent registrations are checked against
+	   each other */
+	if (mp2_assign_cpu(new_task)==false) {
+		up(&mp2_sem);
+		printk(KERN_WARNING "mp2: Registration for PID:%u failed during Admission Control\n",
+		       new_task->pid);
+		mp2_free_task(new_task);
+		return;
+	}
 
-	/* Mark mp2 task state as sleeping */
-	new_task->state = MP2_TASK_SLEEPING;
-}
+	/* Only run on the CPU it was admitted to */
+	c = new_task->cpu;
+	cpumask_copy(new_task->orig_mask, tsk_cpus_allowed(new_task->task));
+	if (set_cpus_allowed_ptr(new_task->task, cpumask_of(c->cpu))) {
+		/* Give the admitted share back */
+		list_del(&new_task->cpu_list);
+		c->nr_tasks--;
+		c->util -= mp2_utilization(new_task);
+		up(&mp2_sem);
+		printk(KERN_WARNING "mp2: Couldn't bind PID:%u to CPU:%d\n",
+		       new_task->pid, c->cpu);
+		mp2_free_task(new_task);
+		return;
+	}
 
-/*
- * Func: mp2_set_sched_priority
- * Desc: Set schedule priority of processes as per given params
- *
- */
-void mp2_set_sched_priority(struct mp2_task_struct *tmp,
-			    int policy,
-			    int priority)
-{
-	struct sched_param sparam;
+	printk(KERN_INFO "mp2: Registration for PID:%u with P:%u and C:%u on CPU:%d\n",
+	       new_task->pid,
+	       new_task->P,
+	       new_task->C,
+	       c->cpu);
 
-	/* Schedule priority */
-	sparam.sched_priority = priority;
-	/* Set the policy and priority */
-	sched_setscheduler(tmp->task, policy, &sparam);
-}
+	list_add_tail(&(new_task->task_list), &mp2_task_struct_list);
+	list_add(&new_task->hash_list, mp2_hash_head(new_task->pid));
 
-/*
- * Func: mp2_irq_disable
- * Desc: Disable IRQ to achieve synchrony between interrupt handler and
- *       kernel thread
- *
- */
-void mp2_irq_disable(void)
-{
-	local_irq_save(flags);
-	local_irq_disable();
-}
+	/* Rerank the tasks of the CPU with the new period */
+	mp2_update_prio(new_task->cpu);
+	mp2_update_wcrt(new_task->cpu);
 
-/*
- * Func: mp2_irq_enable
- * Desc: Enable IRQ again
- *
- */
-void mp2_irq_enable(void)
-{
-	local_irq_restore(flags);
-	local_irq_enable();
+	/* Exit critical region */
+	up(&mp2_sem);
 }
 
 /*
@@ -360,39 +1325,50 @@ void mp2_deregister_process(char *user_data)
 {
 	unsigned int pid;
 	struct mp2_task_struct *tmp;
+	struct mp2_cpu *c;
 
 	/* Extract PID */
 	sscanf(user_data+3, "%u", &pid);
 
+	/* Enter critical region */
+	if (down_interruptible(&mp2_sem)) {
+		printk(KERN_INFO "mp2:Unable to enter critical region\n");
+		return;
+	}
+
 	/* Find the mp2 task struct for this pid */
 	tmp = find_mp2_task_by_pid(pid);
 
 	if (tmp) {
 		printk(KERN_INFO "mp2: De-registration for PID:%u\n", pid);
-		/* Remove the task from run queue */
-		mp2_irq_disable();
+		c = tmp->cpu;
+		/* Delete the task from the task lists and the hash */
+		list_del(&tmp->task_list);
+		list_del(&tmp->cpu_list);
+		list_del(&tmp->hash_list);
+		c->nr_tasks--;
+		c->util -= mp2_utilization(tmp);
+		mp2_update_wcrt(c);
+		/* Remove the task from run queue, after which neither the
+		   timers nor the dispatcher queue or dispatch it again */
+		mp2_irq_disable(c);
+		tmp->removed = true;
 		mp2_remove_task_from_rq(tmp);
-		mp2_irq_enable();
-		/* Enter critical region */
-		if (down_interruptible(&mp2_sem)) {
-			printk(KERN_INFO "mp2:Unable to enter critical region\n");
-			return;
+		if (tmp == c->curr) {
+			c->curr = NULL;
 		}
-		/* Delete the task from mp2 task struct list */
-		list_del(&tmp->task_list);
+		mp2_irq_enable(c);
+		hrtimer_cancel(&tmp->wakeup_timer);
+		hrtimer_cancel(&tmp->budget_timer);
+		/* Reset the priority to normal and the affinity */
+		mp2_release_task(tmp);
 		/* Exit critical region */
 		up(&mp2_sem);
-		/* Delete the timer */
-		del_timer_sync(&tmp->wakeup_timer);
-		if (tmp == mp2_current) {
-			/* Reset the priority to normal */
-			mp2_set_sched_priority(tmp, SCHED_NORMAL, 0);
-			mp2_current = NULL;
-		}
-		/* Free the structure */
-		kfree(tmp);
-		wake_up_interruptible(&mp2_waitqueue);
+		wake_up_interruptible(&c->waitqueue);
+		/* The dispatcher may still be using it */
+		mp2_put_task(tmp);
 	} else {
+		up(&mp2_sem);
 		/* Deregister only registered processes */
 		printk(KERN_INFO "mp2: No process with P:%u registered\n", pid);
 	}
@@ -407,68 +1383,108 @@ void mp2_yield_process(char *user_data)
 {
 	unsigned int pid;
 	struct mp2_task_struct *tmp;
-	u64 release_time;
+	struct mp2_cpu *c;
+	ktime_t now;
+	s64 release_time;
 
 	/* Extract PID */
 	sscanf(user_data+3, "%u", &pid);
 
-	/* Check if this is the current running process */
-	if (mp2_current && (mp2_current->pid == pid)) {
-		tmp = mp2_current;
-	} else {
-		/* Else check on the mp2_task_struct_list */
-		tmp = find_mp2_task_by_pid(pid);
+	/* Keep deregistration from freeing the task under us */
+	if (down_interruptible(&mp2_sem)) {
+		printk(KERN_INFO "mp2:Unable to enter critical region\n");
+		return;
 	}
 
+	/* Look it up in the hash table */
+	tmp = find_mp2_task_by_pid(pid);
+
 	/* If process is not found on the list, something is wrong */
 	if (tmp == NULL) {
+		up(&mp2_sem);
 		printk(KERN_WARNING "mp2: Task not found for yield:%u\n",pid);
 		return;
 	}
+	c = tmp->cpu;
+
+	/* Lower the priority of the task before the dispatcher can see the
+	   yield, or this could undo a fresh dispatch */
+	mp2_set_sched_priority(tmp, SCHED_NORMAL, 0);
+
+	/* Sleep from before the task is requeued and the dispatcher woken.
+	   Once requeued it can be dispatched at any time, and the wakeup
+	   of that dispatch must not be lost */
+	set_current_state(TASK_UNINTERRUPTIBLE);
+
+	/* The job is done with its budget */
+	hrtimer_cancel(&tmp->budget_timer);
+
+	/* Account the completion of the released job. Its deadline is
+	   the next release */
+	now = ktime_get();
+	mp2_irq_disable(c);
+	tmp->exhausted = false;
+	if (tmp->job_active) {
+		tmp->job_active = false;
+		tmp->stats.completed++;
+		mp2_dist_add(&tmp->stats.response,
+			     ktime_to_ns(ktime_sub(now, tmp->next_period)) +
+			     (s64)tmp->P * NSEC_PER_USEC);
+		if (ktime_to_ns(now) > ktime_to_ns(tmp->next_period)) {
+			tmp->stats.misses++;
+		}
+	}
+	mp2_irq_enable(c);
 
 	/* Check if we still have time for next release */
-	if (jiffies < tmp->next_period) {
+	if (ktime_to_ns(now) < ktime_to_ns(tmp->next_period)) {
 		/* If yes, put this task in sleep state
 		   remove it from rq(if present there,
 		   and start the timer
 		*/
-		release_time = tmp->next_period - jiffies;
-		printk(KERN_INFO "mp2: release_time:%llu,%d\n", release_time,tmp->pid);
+		release_time = ktime_us_delta(tmp->next_period, now);
+		printk(KERN_INFO "mp2: release_time:%lldus,%d\n", release_time,tmp->pid);
 
 		/* Change the task state to SLEEPING */
 		tmp->state = MP2_TASK_SLEEPING;
 
-		/* Start the timer according to release time */
-		mod_timer(&tmp->wakeup_timer, jiffies + release_time);
-
 		/* If this task was currently executing,
 		   remove it from run queue and wake up
-		   scheduler thread */
-		if (mp2_current && (mp2_current->pid == tmp->pid)) {
-			mp2_irq_disable();
-			mp2_remove_task_from_rq(tmp);
-			mp2_irq_enable();
-			mp2_current = NULL;
-			wake_up_interruptible(&mp2_waitqueue);
+		   scheduler thread. Done before arming the timer,
+		   which would queue it again */
+		mp2_irq_disable(c);
+		mp2_remove_task_from_rq(tmp);
+		if (c->curr == tmp) {
+			c->curr = NULL;
 		}
+		mp2_irq_enable(c);
+		wake_up_interruptible(&c->waitqueue);
+
+		/* Start the timer on the absolute release time */
+		hrtimer_start(&tmp->wakeup_timer, tmp->next_period,
+			      HRTIMER_MODE_ABS);
 	} else {
-		/* Process needs to be on run queue
-		   If in sleeping state, move it to run queue
+		/* The next job is already due: release it now, which
+		   moves its deadline, and requeue the task under it
 		*/
-		if (tmp->state == MP2_TASK_SLEEPING) {
-			tmp->state = MP2_TASK_READY;
-			mp2_irq_disable();
-			mp2_add_task_to_rq(tmp);
-			mp2_irq_enable();
+		mp2_irq_disable(c);
+		mp2_remove_task_from_rq(tmp);
+		mp2_dist_add(&tmp->stats.jitter,
+			     ktime_to_ns(ktime_sub(now, tmp->next_period)));
+		tmp->next_period = ktime_add_us(tmp->next_period, tmp->P);
+		tmp->budget_left = (u64)tmp->C * NSEC_PER_USEC;
+		tmp->job_active = true;
+		tmp->stats.released++;
+		mp2_add_task_to_rq(tmp);
+		if (c->curr == tmp) {
+			c->curr = NULL;
 		}
-		wake_up_interruptible(&mp2_waitqueue);
-		mp2_current = NULL;
+		mp2_irq_enable(c);
+		wake_up_interruptible(&c->waitqueue);
 	}
 
-	/* Lower the priority of the task */
-	mp2_set_sched_priority(tmp, SCHED_NORMAL, 0);
+	up(&mp2_sem);
 
-	set_task_state(tmp->task, TASK_UNINTERRUPTIBLE);
 	printk(KERN_INFO "mp2: Yield for %u\n",pid);
 
 	schedule();
@@ -479,12 +1495,12 @@ void mp2_yield_process(char *user_data)
  * Desc: Write handler for a proc entry
  *
  */
-int mp2_write_proc(struct file *filp, const char __user *buff,
-		   unsigned long len, void *data)
+static ssize_t mp2_write_proc(struct file *filp, const char __user *buff,
+			      size_t len, loff_t *off)
 {
 #define MAX_USER_DATA_LEN 50
 
-	char user_data[MAX_USER_DATA_LEN];
+	char user_data[MAX_USER_DATA_LEN + 1];
 
 	if (len > MAX_USER_DATA_LEN) {
 		printk(KERN_WARNING "mp2: truncating user data\n");
@@ -497,6 +1513,7 @@ int mp2_write_proc(struct file *filp, const char __user *buff,
 			   len)) {
 		return -EFAULT;
 	}
+	user_data[len] = '\0';
 
 	/* Switch according to user process command */
 	switch (user_data[0]) {
@@ -520,22 +1537,80 @@ int mp2_write_proc(struct file *filp, const char __user *buff,
 	return len;
 }
 
+/* File operations for /proc/mp2/status */
+static const struct file_operations mp2_proc_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mp2_open_proc,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release,
+	.write   = mp2_write_proc,
+};
+
 /*
- * Func: mp2_sched_kthread_fn
- * Desc: Dispatcher thread
+ * Func: mp2_handle_overrun
+ * Desc: Take the CPU back from a dispatched job that exhausted its budget.
+ *       It is demoted to SCHED_NORMAL until it yields, or with
+ *       overrun_suspend stopped with SIGSTOP until its next job is
+ *       dispatched, with a new budget. Either way it leaves the run queue
+ *       so that the other tasks keep their guarantees
  *
  */
-int mp2_sched_kthread_fn(void *unused)
+void mp2_handle_overrun(struct mp2_cpu *c)
 {
 	struct mp2_task_struct *tmp;
 
+	mp2_irq_disable(c);
+	tmp = c->curr;
+	if (tmp == NULL || !tmp->exhausted) {
+		mp2_irq_enable(c);
+		return;
+	}
+	tmp->exhausted = false;
+	tmp->stats.overruns++;
+	mp2_remove_task_from_rq(tmp);
+	c->curr = NULL;
+
+	if (overrun_suspend) {
+		tmp->state = MP2_TASK_SLEEPING;
+		send_sig(SIGSTOP, tmp->task, 1);
+		tmp->stopped = true;
+		/* The next release requeues it */
+		hrtimer_start(&tmp->wakeup_timer, tmp->next_period,
+			      HRTIMER_MODE_ABS);
+	} else {
+		tmp->state = MP2_TASK_READY;
+	}
+
+	/* Keep it while its policy changes outside the lock */
+	mp2_get_task(tmp);
+	mp2_irq_enable(c);
+
+	printk(KERN_WARNING "mp2: PID:%u overran its budget of %uus\n",
+	       tmp->pid, tmp->C);
+
+	mp2_set_sched_priority(tmp, SCHED_NORMAL, 0);
+	mp2_put_task(tmp);
+}
+
+/*
+ * Func: mp2_sched_kthread_fn
+ * Desc: Dispatcher thread of one CPU
+ *
+ */
+int mp2_sched_kthread_fn(void *data)
+{
+	struct mp2_cpu *c = data;
+	struct mp2_task_struct *tmp, *prev;
+	int ret;
+
 	/* Declare a wait queue */
 	DECLARE_WAITQUEUE(wait,current);
 
 	/* Add wait queue to the head */
-	add_wait_queue(&mp2_waitqueue,&wait);
+	add_wait_queue(&c->waitqueue,&wait);
 
-	printk(KERN_INFO "mp2: Schedule Thread created\n");
+	printk(KERN_INFO "mp2: Schedule Thread created for CPU:%d\n", c->cpu);
 
 	while (1) {
 		/* printk(KERN_INFO "mp2: Schedule thread sleeping\n"); */
@@ -553,55 +1628,278 @@ int mp2_sched_kthread_fn(void *unused)
 
 		/* printk(KERN_INFO "mp2: Schedule function running\n"); */
 
-		/* Check if we have anything on the runqueue */
-		if (!list_empty(&mp2_rq)) {
-			/* If there is a task waiting on the run queue,
-			   and has a higher priority than current running task if any
-			   schedule it
-			*/
-			mp2_irq_disable();
-			tmp = list_first_entry(&mp2_rq, typeof(*tmp), mp2_rq_list);
-			mp2_irq_enable();
-			/* If there is some task running currenly,
-			   put it into ready state */
-			if (mp2_current) {
-				if (mp2_current->P > tmp->P) {
-					printk(KERN_INFO "mp2: Scheduling out current process\n");
-					mp2_set_sched_priority(mp2_current, SCHED_NORMAL, 0);
-					set_task_state(mp2_current->task, TASK_UNINTERRUPTIBLE);
-					mp2_current->state = MP2_TASK_READY;
-					mp2_current = NULL;
-				}
-				else {
-					printk(KERN_INFO "mp2: currently running process has higher prio\n");
-					continue;
-				}
-			}
+		/* Stop a job that ran out of budget first */
+		mp2_handle_overrun(c);
+
+		/* Check if we have anything on the runqueue, and whether
+		   it preempts the currently running task if any. Both are
+		   referenced so that deregistration can't free them while
+		   their policies change outside the lock */
+		mp2_irq_disable(c);
+		tmp = mp2_pick_task(c);
+		if (tmp == NULL || tmp == c->curr) {
+			mp2_irq_enable(c);
+			continue;
+		}
+		prev = c->curr;
+		if (prev && !mp2_preempts(tmp, prev)) {
+			mp2_irq_enable(c);
+			printk(KERN_INFO "mp2: currently running process has higher prio\n");
+			continue;
+		}
+		if (prev) {
+			/* Put it into ready state */
+			prev->stats.preemptions++;
+			prev->state = MP2_TASK_READY;
+			mp2_get_task(prev);
+		}
+		/* update the current variable */
+		c->curr = tmp;
+		/* Set the state to RUNNING */
+		tmp->state = MP2_TASK_RUNNING;
+		mp2_get_task(tmp);
+		mp2_irq_enable(c);
+
+		if (prev) {
+			printk(KERN_INFO "mp2: Scheduling out current process\n");
+			mp2_budget_stop(prev);
+			mp2_set_sched_priority(prev, SCHED_NORMAL, 0);
+			set_task_state(prev->task, TASK_UNINTERRUPTIBLE);
+			mp2_put_task(prev);
+		}
 
+		/* Raise its priority, below the dispatcher's */
+		ret = mp2_set_sched_priority(tmp, SCHED_FIFO, MP2_TASK_RT_PRIO);
+
+		mp2_irq_disable(c);
+		if (c->curr != tmp) {
+			/* It yielded or was deregistered meanwhile, which
+			   may have set its policy before we did */
+			mp2_irq_enable(c);
+			if (ret == 0) {
+				mp2_set_sched_priority(tmp, SCHED_NORMAL, 0);
+			}
+		} else if (ret) {
+			/* It stays queued */
+			c->curr = NULL;
+			tmp->state = MP2_TASK_READY;
+			mp2_irq_enable(c);
+		} else {
+			/* Continue it if it was stopped for an overrun */
+			if (tmp->stopped) {
+				send_sig(SIGCONT, tmp->task, 1);
+				tmp->stopped = false;
+			}
+			/* Charge the job from now on */
+			mp2_budget_start(tmp);
+			mp2_irq_enable(c);
 			/* Wake up the selected process */
 			wake_up_process(tmp->task);
-			/* Raise its priority */
-			mp2_set_sched_priority(tmp, SCHED_FIFO, MAX_USER_RT_PRIO - 1);
-			/* update the current variable */
-			mp2_current = tmp;
-			/* Set the state to RUNNING */
-			mp2_current->state = MP2_TASK_RUNNING;
 			printk(KERN_INFO "next task running:%d\n",tmp->pid);
-			/* Update the next releast time */
-			mp2_current->next_period += msecs_to_jiffies(mp2_current->P);
 		}
+
+		mp2_put_task(tmp);
 	}
 
 	/* exiting thread, set it to running state */
         set_current_state(TASK_RUNNING);
 
         /* remove the waitqueue */
-        remove_wait_queue(&mp2_waitqueue, &wait);
+        remove_wait_queue(&c->waitqueue, &wait);
 
         printk(KERN_INFO "mp2: Schedule thread killed\n");
         return 0;
 }
 
+/*
+ * Func: mp2_bench_sorted_add
+ * Desc: Insertion into the period sorted run queue list mp2 used before
+ *       the priority array, kept to compare release costs
+ *
+ */
+static void mp2_bench_sorted_add(struct list_head *rq,
+				 struct mp2_task_struct *tmp)
+{
+	struct mp2_task_struct *curr_task;
+
+	list_for_each_entry(curr_task, rq, mp2_rq_list) {
+		if (curr_task->P > tmp->P) {
+			break;
+		}
+	}
+	list_add_tail(&tmp->mp2_rq_list, &curr_task->mp2_rq_list);
+}
+
+/*
+ * Func: mp2_rq_bench
+ * Desc: Release 10, 100 and 1000 dummy tasks into the sorted list and
+ *       into the priority array run queue and print the average cost of
+ *       a release and of picking and removing the next task
+ *
+ */
+static void mp2_rq_bench(void)
+{
+	static const unsigned int sizes[] = { 10, 100, 1000 };
+	struct mp2_runqueue *rq;
+	struct mp2_task_struct *tasks, *tmp;
+	struct list_head sorted;
+	u64 start, list_add_ns, list_pick_ns, rq_add_ns, rq_pick_ns;
+	unsigned long flags;
+	unsigned int i, j, n;
+
+	/* The dummy tasks are full task structs, with their timers and
+	   statistics: too large to ask for in one contiguous piece */
+	rq = kmalloc(sizeof(*rq), GFP_KERNEL);
+	tasks = vzalloc(MP2_NR_PRIO * sizeof(*tasks));
+	if (rq == NULL || tasks == NULL) {
+		printk(KERN_WARNING "mp2: Out of memory for rq_bench\n");
+		goto out;
+	}
+
+	for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+		n = sizes[j];
+
+		/* Spread the periods, the rank follows the period */
+		for (i = 0; i < n; i++) {
+			tasks[i].P = 10 + (i * 7919) % MP2_NR_PRIO;
+			tasks[i].prio = tasks[i].P - 10;
+			INIT_LIST_HEAD(&tasks[i].mp2_rq_list);
+		}
+
+		/* Sorted list */
+		INIT_LIST_HEAD(&sorted);
+		local_irq_save(flags);
+		start = ktime_to_ns(ktime_get());
+		for (i = 0; i < n; i++) {
+			mp2_bench_sorted_add(&sorted, &tasks[i]);
+		}
+		list_add_ns = ktime_to_ns(ktime_get()) - start;
+
+		start = ktime_to_ns(ktime_get());
+		for (i = 0; i < n; i++) {
+			tmp = list_first_entry(&sorted, typeof(*tmp),
+					       mp2_rq_list);
+			list_del_init(&tmp->mp2_rq_list);
+		}
+		list_pick_ns = ktime_to_ns(ktime_get()) - start;
+		local_irq_restore(flags);
+
+		/* Priority array */
+		mp2_rq_init(rq);
+		local_irq_save(flags);
+		start = ktime_to_ns(ktime_get());
+		for (i = 0; i < n; i++) {
+			mp2_rq_enqueue(rq, &tasks[i]);
+		}
+		rq_add_ns = ktime_to_ns(ktime_get()) - start;
+
+		start = ktime_to_ns(ktime_get());
+		for (i = 0; i < n; i++) {
+			mp2_rq_dequeue(rq, mp2_rq_pick(rq));
+		}
+		rq_pick_ns = ktime_to_ns(ktime_get()) - start;
+		local_irq_restore(flags);
+
+		printk(KERN_INFO "mp2: rq_bench tasks:%u sorted_release_ns:%llu sorted_pick_ns:%llu bitmap_release_ns:%llu bitmap_pick_ns:%llu\n",
+		       n, div_u64(list_add_ns, n), div_u64(list_pick_ns, n),
+		       div_u64(rq_add_ns, n), div_u64(rq_pick_ns, n));
+	}
+
+out:
+	vfree(tasks);
+	kfree(rq);
+}
+
+/*
+ * Func: mp2_cpus_stop
+ * Desc: Stop the dispatcher threads
+ *
+ */
+static void mp2_cpus_stop(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (mp2_cpus[cpu] && mp2_cpus[cpu]->kthread) {
+			wake_up_interruptible(&mp2_cpus[cpu]->waitqueue);
+			kthread_stop(mp2_cpus[cpu]->kthread);
+			mp2_cpus[cpu]->kthread = NULL;
+		}
+	}
+}
+
+/*
+ * Func: mp2_cpus_free
+ * Desc: Free the per CPU scheduler state
+ *
+ */
+static void mp2_cpus_free(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kfree(mp2_cpus[cpu]);
+		mp2_cpus[cpu] = NULL;
+	}
+}
+
+/*
+ * Func: mp2_cpus_init
+ * Desc: Set up the scheduler state of every online CPU and start its
+ *       dispatcher thread bound to it. CPUs that come online later are
+ *       not used
+ *
+ */
+static int mp2_cpus_init(void)
+{
+	struct sched_param sparam = { .sched_priority = MP2_SCHED_RT_PRIO };
+	struct mp2_cpu *c;
+	int cpu, ret = -ENOMEM;
+
+	for_each_online_cpu(cpu) {
+		c = kzalloc(sizeof(*c), GFP_KERNEL);
+		if (c == NULL) {
+			goto fail;
+		}
+
+		c->cpu = cpu;
+		spin_lock_init(&c->lock);
+		mp2_rq_init(&c->rq);
+		c->edf_rq = RB_ROOT;
+		INIT_LIST_HEAD(&c->tasks);
+		init_waitqueue_head(&c->waitqueue);
+		mp2_cpus[cpu] = c;
+	}
+
+	for_each_online_cpu(cpu) {
+		c = mp2_cpus[cpu];
+		c->kthread = kthread_create(mp2_sched_kthread_fn, c,
+					    "mp2_sched/%d", cpu);
+		if (IS_ERR(c->kthread)) {
+			ret = PTR_ERR(c->kthread);
+			c->kthread = NULL;
+			goto fail;
+		}
+		kthread_bind(c->kthread, cpu);
+		/* Above the dispatched tasks, to preempt and throttle them.
+		   Without it the dispatcher could never take the CPU back */
+		ret = sched_setscheduler(c->kthread, SCHED_FIFO, &sparam);
+		if (ret) {
+			printk(KERN_WARNING "mp2: Couldn't make the dispatcher of CPU:%d real-time\n",
+			       cpu);
+			goto fail;
+		}
+		wake_up_process(c->kthread);
+	}
+
+	return 0;
+
+fail:
+	mp2_cpus_stop();
+	mp2_cpus_free();
+	return ret;
+}
+
 /*
  * Func: mp2_init_module
  * Desc: Init module for kernel module loading
@@ -610,6 +1908,7 @@ int mp2_sched_kthread_fn(void *unused)
 static int __init mp2_init_module(void)
 {
 	int ret = 0;
+	int i;
 
 	/* Create a proc directory entry mp2 */
 	proc_dir = proc_mkdir("mp2", NULL);
@@ -620,7 +1919,8 @@ static int __init mp2_init_module(void)
 		ret = -ENOMEM;
 	} else {
 		/* Create an entry status under proc dir mp2 */
-		proc_entry = create_proc_entry( "status", 0666, proc_dir);
+		proc_entry = proc_create("status", 0666, proc_dir,
+					 &mp2_proc_fops);
 
 		/*Check if entry was created */
 		if (proc_entry == NULL) {
@@ -628,29 +1928,43 @@ static int __init mp2_init_module(void)
 			ret = -ENOMEM;
 		} else {
 
-			/* proc_entry->owner = THIS_MODULE; */
-			proc_entry->read_proc = mp2_read_proc;
-			proc_entry->write_proc = mp2_write_proc;
-
 			/* Initialize list head for MP2 task struct */
 			INIT_LIST_HEAD(&mp2_task_struct_list);
 
-			/* Initialize list head for MP2 run queue */
-			INIT_LIST_HEAD(&mp2_rq);
+			/* Initialize the pid hash table */
+			for (i = 0; i < (1 << MP2_HASH_BITS); i++) {
+				INIT_LIST_HEAD(&mp2_hash[i]);
+			}
+
+			/* Compare with the old run queue if asked for */
+			if (rq_bench) {
+				mp2_rq_bench();
+			}
 
 			/* Initialize semaphore */
                         sema_init(&mp2_sem,1);
 
-			/* Initialize current running mp2 task as NULL */
-			mp2_current = NULL;
-
-                        /* Create a kernel thread */
-                        mp2_sched_kthread = kthread_run(mp2_sched_kthread_fn,
-                                                        NULL,
-                                                        "mp2_sched_kthread");
+			/* Run queues and a dispatcher thread per CPU */
+			ret = mp2_cpus_init();
+
+			/* Create the stats entry once there is something
+			   to account */
+			if (ret == 0 &&
+			    proc_create("stats", 0666, proc_dir,
+					&mp2_stats_fops) == NULL) {
+				printk(KERN_INFO "mp2: Couldn't create proc entry\n");
+				mp2_cpus_stop();
+				mp2_cpus_free();
+				ret = -ENOMEM;
+			}
 
-			/* MP2 module is now loaded */
-			printk(KERN_INFO "mp2: Module loaded\n");
+			if (ret) {
+				remove_proc_entry("status", proc_dir);
+				remove_proc_entry("mp2", NULL);
+			} else {
+				/* MP2 module is now loaded */
+				printk(KERN_INFO "mp2: Module loaded\n");
+			}
 		}
 	}
 
@@ -665,12 +1979,16 @@ static void __exit mp2_exit_module(void)
 {
 	struct mp2_task_struct *tmp, *swap;
 
-	/* Remove the status entry first */
+	/* Remove the status and stats entries first */
 	remove_proc_entry("status", proc_dir);
+	remove_proc_entry("stats", proc_dir);
 
 	/* Remove the mp2 proc dir now */
 	remove_proc_entry("mp2", NULL);
 
+	/* Stop the dispatchers before freeing the tasks they may pick */
+	mp2_cpus_stop();
+
 	/* Enter critical region */
         if (down_interruptible(&mp2_sem)) {
                 printk(KERN_INFO "mp2:Unable to enter critical region\n");
@@ -681,17 +1999,18 @@ static void __exit mp2_exit_module(void)
         list_for_each_entry_safe(tmp, swap, &mp2_task_struct_list, task_list) {
 		printk(KERN_INFO "mp2: freeing %u\n",tmp->pid);
 		list_del(&tmp->task_list);
-		kfree(tmp);
+		list_del(&tmp->hash_list);
+		hrtimer_cancel(&tmp->wakeup_timer);
+		hrtimer_cancel(&tmp->budget_timer);
+		/* It keeps running after the module is gone */
+		mp2_release_task(tmp);
+		mp2_free_task(tmp);
         }
 
 	/* Exit critical region */
 	up(&mp2_sem);
 
-	/* Before stopping the thread, put it into running state */
-        wake_up_interruptible(&mp2_waitqueue);
-
-        /* now stop the thread */
-        kthread_stop(mp2_sched_kthread);
+	mp2_cpus_free();
 
  	printk(KERN_INFO "mp2: Module unloaded\n");
 }
@@ -0,0 +1,258 @@
+/*
+ * mp2_sim.c: Task set simulation comparing RMS and EDF for mp2
+ *
+ * Generates random periodic task sets (implicit deadlines) at increasing
+ * total utilization, simulates them under preemptive rate monotonic and
+ * earliest deadline first scheduling, and prints for each utilization
+ * the share of task sets the mp2 admission tests accept and the share
+ * that actually meet all their deadlines under each policy.
+ *
+ * Usage: mp2_sim [nr_tasks] [sets_per_point] [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_TASKS 32
+
+/* Simulated time is cut at this many ticks if the hyperperiod is longer */
+#define MAX_HORIZON 100000
+
+/* Policies */
+#define RMS 0
+#define EDF 1
+
+/* One periodic task, times in ticks */
+struct sim_task {
+	unsigned int P;
+	unsigned int C;
+	/* Work left in the current job */
+	unsigned int left;
+	/* Absolute deadline of the current job */
+	unsigned long deadline;
+};
+
+/*
+ * Func: gcd
+ * Desc: Greatest common divisor
+ *
+ */
+unsigned long gcd(unsigned long a, unsigned long b)
+{
+	while (b) {
+		unsigned long t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+ * Func: horizon
+ * Desc: Hyperperiod of the task set, capped at MAX_HORIZON
+ *
+ */
+unsigned long horizon(struct sim_task *t, int n)
+{
+	unsigned long h = 1;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		h = h / gcd(h, t[i].P) * t[i].P;
+		if (h > MAX_HORIZON) {
+			return MAX_HORIZON;
+		}
+	}
+	return h;
+}
+
+/*
+ * Func: generate
+ * Desc: Random task set of total utilization about u. Utilizations are
+ *       drawn with UUniFast, periods are multiples of 10 ticks up to 200
+ *
+ */
+void generate(struct sim_task *t, int n, double u)
+{
+	double sum = u, next, ui;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (i < n - 1) {
+			next = sum * pow((double)rand() / RAND_MAX,
+					 1.0 / (n - i - 1));
+			ui = sum - next;
+			sum = next;
+		} else {
+			ui = sum;
+		}
+
+		t[i].P = 10 * (1 + rand() % 20);
+		t[i].C = (unsigned int)(ui * t[i].P + 0.5);
+		if (t[i].C == 0) {
+			t[i].C = 1;
+		}
+		if (t[i].C > t[i].P) {
+			t[i].C = t[i].P;
+		}
+	}
+}
+
+/*
+ * Func: admitted
+ * Desc: mp2_admission_control utilization test on the whole set: sum of
+ *       C/P in 20 bit fixed point, rounded up, against ln 2 for RMS and
+ *       1 for EDF
+ *
+ */
+int admitted(struct sim_task *t, int n, int policy)
+{
+	unsigned long long total = 0, one = 1ULL << 20;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		total += (((unsigned long long)t[i].C << 20) + t[i].P - 1) /
+			 t[i].P;
+	}
+
+	return total <= (policy == EDF ? one : 693 * one / 1000);
+}
+
+/*
+ * Func: rta_admitted
+ * Desc: Exact response time analysis under RMS, as the module does with
+ *       rta=1
+ *
+ */
+int rta_admitted(struct sim_task *t, int n)
+{
+	unsigned long R, next;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		R = 0;
+		next = t[i].C;
+		while (next != R && next <= t[i].P) {
+			R = next;
+			next = t[i].C;
+			for (j = 0; j < n; j++) {
+				if (j != i && t[j].P <= t[i].P) {
+					next += (R + t[j].P - 1) / t[j].P * t[j].C;
+				}
+			}
+		}
+		if (next > t[i].P) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Func: schedulable
+ * Desc: Simulate the set one tick at a time from a synchronous release
+ *       and return 1 if no job misses its deadline
+ *
+ */
+int schedulable(struct sim_task *t, int n, int policy)
+{
+	unsigned long now, end = horizon(t, n);
+	int i, run;
+
+	for (i = 0; i < n; i++) {
+		t[i].left = 0;
+		t[i].deadline = 0;
+	}
+
+	for (now = 0; now < end; now++) {
+		/* Releases. Work left at the deadline is a miss */
+		for (i = 0; i < n; i++) {
+			if (now % t[i].P == 0) {
+				if (t[i].left) {
+					return 0;
+				}
+				t[i].left = t[i].C;
+				t[i].deadline = now + t[i].P;
+			}
+		}
+
+		/* Pick the highest priority ready job */
+		run = -1;
+		for (i = 0; i < n; i++) {
+			if (t[i].left == 0) {
+				continue;
+			}
+			if (run < 0 ||
+			    (policy == RMS && t[i].P < t[run].P) ||
+			    (policy == EDF && t[i].deadline < t[run].deadline)) {
+				run = i;
+			}
+		}
+
+		if (run >= 0) {
+			t[run].left--;
+		}
+	}
+
+	/* Jobs due at the end of the horizon */
+	for (i = 0; i < n; i++) {
+		if (t[i].left && t[i].deadline <= end) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct sim_task t[MAX_TASKS];
+	int n = 5, sets = 200, i, p;
+	unsigned int seed = 1;
+	int rms_admit, rta_admit, rms_ok, edf_admit, edf_ok;
+	double u;
+
+	if (argc > 1) {
+		n = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		sets = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		seed = atoi(argv[3]);
+	}
+	if (n < 1 || n > MAX_TASKS || sets < 1) {
+		fprintf(stderr, "usage: %s [nr_tasks] [sets_per_point] [seed]\n",
+			argv[0]);
+		return 1;
+	}
+	srand(seed);
+
+	printf("tasks=%d sets=%d\n", n, sets);
+	printf("%-6s %-10s %-10s %-10s %-10s %-10s\n", "util", "rms_admit",
+	       "rta_admit", "rms_sched", "edf_admit", "edf_sched");
+
+	for (p = 50; p <= 100; p += 5) {
+		u = p / 100.0;
+		rms_admit = rta_admit = rms_ok = edf_admit = edf_ok = 0;
+
+		for (i = 0; i < sets; i++) {
+			generate(t, n, u);
+			rms_admit += admitted(t, n, RMS);
+			rta_admit += rta_admitted(t, n);
+			edf_admit += admitted(t, n, EDF);
+			rms_ok += schedulable(t, n, RMS);
+			edf_ok += schedulable(t, n, EDF);
+		}
+
+		printf("%-6.2f %-10.1f %-10.1f %-10.1f %-10.1f %-10.1f\n", u,
+		       100.0 * rms_admit / sets, 100.0 * rta_admit / sets,
+		       100.0 * rms_ok / sets,
+		       100.0 * edf_admit / sets, 100.0 * edf_ok / sets);
+	}
+
+	return 0;
+}
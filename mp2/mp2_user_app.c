@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <time.h>
 
 /* Command structure for giving different params */
@@ -18,7 +19,7 @@ struct command {
 	unsigned int n;
 };
 
-/* Different P, C and n values */
+/* Different P, C and n values, P and C in milliseconds */
 struct command cmd[] = {
 	{450, 300, 10},
 	{600, 300, 10},
@@ -58,7 +59,8 @@ void register_process(unsigned int pid,
 {
 	char command[100];
 
-	sprintf(command, "R, %d, %d, %d.", pid,P,C);
+	/* The module takes P and C in microseconds */
+	sprintf(command, "R, %d, %u, %u.", pid,P*1000,C*1000);
 	write(fd,command,strlen(command));
 }
 
@@ -189,6 +191,12 @@ int main(int argc, char **argv)
 		n = atoi(argv[3]);
 	}
 
+	/* P and C are sent in microseconds, which must fit in 32 bits */
+	if (P > UINT_MAX / 1000 || C > UINT_MAX / 1000) {
+		printf("P and C must be at most %u ms\n", UINT_MAX / 1000);
+		return 1;
+	}
+
 	/* Get PID of the process */
 	pid = getpid();
 	printf("PID of process is %u,P=%u,C=%u,n=%d\n",pid,P,C,n);